@@ -0,0 +1,268 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CODEC_X86
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+// Bit pairs never cross a byte boundary, so every kernel below works on
+// arbitrary byte lengths and leaves the tail to the scalar loop.
+
+static void codec_scalar(uint8_t *p, unsigned long size)
+{
+	while (size >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		// Swap every 2 bits
+		v = ((v & 0xaaaaaaaaaaaaaaaaULL) >> 1) | ((v & 0x5555555555555555ULL) << 1);
+		memcpy(p, &v, sizeof(v));
+		p += 8;
+		size -= 8;
+	}
+	while (size--) {
+		*p = ((*p & 0xaa) >> 1) | ((*p & 0x55) << 1);
+		p++;
+	}
+}
+
+#ifdef CODEC_X86
+__attribute__((target("sse2")))
+static void codec_sse2(uint8_t *p, unsigned long size)
+{
+	const __m128i mask = _mm_set1_epi8(0x55);
+	while (size >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		v = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 1), mask),
+				_mm_slli_epi16(_mm_and_si128(v, mask), 1));
+		_mm_storeu_si128((__m128i *)p, v);
+		p += 16;
+		size -= 16;
+	}
+	codec_scalar(p, size);
+}
+
+__attribute__((target("avx2")))
+static void codec_avx2(uint8_t *p, unsigned long size)
+{
+	const __m256i mask = _mm256_set1_epi8(0x55);
+	while (size >= 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+		v0 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v0, 1), mask),
+				_mm256_slli_epi16(_mm256_and_si256(v0, mask), 1));
+		v1 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v1, 1), mask),
+				_mm256_slli_epi16(_mm256_and_si256(v1, mask), 1));
+		_mm256_storeu_si256((__m256i *)p, v0);
+		_mm256_storeu_si256((__m256i *)(p + 32), v1);
+		p += 64;
+		size -= 64;
+	}
+	codec_sse2(p, size);
+}
+#endif
+
+#ifdef __ARM_NEON
+static void codec_neon(uint8_t *p, unsigned long size)
+{
+	const uint8x16_t mask = vdupq_n_u8(0x55);
+	while (size >= 16) {
+		uint8x16_t v = vld1q_u8(p);
+		v = vorrq_u8(vandq_u8(vshrq_n_u8(v, 1), mask), vshlq_n_u8(vandq_u8(v, mask), 1));
+		vst1q_u8(p, v);
+		p += 16;
+		size -= 16;
+	}
+	codec_scalar(p, size);
+}
+#endif
+
+struct codec_kernel_t codec_kernels[] = {
+	{"scalar", 1, codec_scalar},
+#if defined(CODEC_X86)
+	{"sse2", 0, codec_sse2},
+	{"avx2", 0, codec_avx2},
+#elif defined(__ARM_NEON)
+	{"neon", 1, codec_neon},
+#endif
+	{NULL, 0, NULL},
+};
+
+static void (*codec_kernel)(uint8_t *p, unsigned long size) = codec_scalar;
+
+// Select the kernel at load time, before any thread can call codec()
+__attribute__((constructor))
+static void codec_init(void)
+{
+#if defined(CODEC_X86)
+	__builtin_cpu_init();
+	codec_kernels[1].supported = __builtin_cpu_supports("sse2");
+	codec_kernels[2].supported = __builtin_cpu_supports("avx2");
+#endif
+	for (struct codec_kernel_t *k = codec_kernels; k->name; k++)
+		if (k->supported)
+			codec_kernel = k->f;
+}
+
+void codec(void *p, unsigned long size)
+{
+	codec_kernel((uint8_t *)p, size);
+}
+
+// XOR kernels take a 64 byte key, the pattern rotated to the current
+// phase and repeated to fill one cache line, and stop at the last full
+// line. The key is loaded into registers once per call.
+
+static void xor_scalar(uint8_t *dst, const uint8_t *src, unsigned long size, const uint8_t *key)
+{
+	uint64_t k[8];
+	memcpy(k, key, sizeof(k));
+	while (size >= 64) {
+		for (int i = 0; i < 8; i++) {
+			uint64_t v;
+			memcpy(&v, src + i * 8, sizeof(v));
+			v ^= k[i];
+			memcpy(dst + i * 8, &v, sizeof(v));
+		}
+		src += 64;
+		dst += 64;
+		size -= 64;
+	}
+}
+
+#ifdef CODEC_X86
+__attribute__((target("sse2")))
+static void xor_sse2(uint8_t *dst, const uint8_t *src, unsigned long size, const uint8_t *key)
+{
+	const __m128i k0 = _mm_loadu_si128((const __m128i *)key);
+	const __m128i k1 = _mm_loadu_si128((const __m128i *)(key + 16));
+	const __m128i k2 = _mm_loadu_si128((const __m128i *)(key + 32));
+	const __m128i k3 = _mm_loadu_si128((const __m128i *)(key + 48));
+	while (size >= 64) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)src);
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i *)(src + 48));
+		_mm_storeu_si128((__m128i *)dst, _mm_xor_si128(v0, k0));
+		_mm_storeu_si128((__m128i *)(dst + 16), _mm_xor_si128(v1, k1));
+		_mm_storeu_si128((__m128i *)(dst + 32), _mm_xor_si128(v2, k2));
+		_mm_storeu_si128((__m128i *)(dst + 48), _mm_xor_si128(v3, k3));
+		src += 64;
+		dst += 64;
+		size -= 64;
+	}
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(uint8_t *dst, const uint8_t *src, unsigned long size, const uint8_t *key)
+{
+	const __m256i k0 = _mm256_loadu_si256((const __m256i *)key);
+	const __m256i k1 = _mm256_loadu_si256((const __m256i *)(key + 32));
+	while (size >= 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)src);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+		_mm256_storeu_si256((__m256i *)dst, _mm256_xor_si256(v0, k0));
+		_mm256_storeu_si256((__m256i *)(dst + 32), _mm256_xor_si256(v1, k1));
+		src += 64;
+		dst += 64;
+		size -= 64;
+	}
+}
+
+__attribute__((target("avx512f")))
+static void xor_avx512(uint8_t *dst, const uint8_t *src, unsigned long size, const uint8_t *key)
+{
+	const __m512i k = _mm512_loadu_si512(key);
+	while (size >= 128) {
+		__m512i v0 = _mm512_loadu_si512(src);
+		__m512i v1 = _mm512_loadu_si512(src + 64);
+		_mm512_storeu_si512(dst, _mm512_xor_si512(v0, k));
+		_mm512_storeu_si512(dst + 64, _mm512_xor_si512(v1, k));
+		src += 128;
+		dst += 128;
+		size -= 128;
+	}
+	if (size >= 64)
+		_mm512_storeu_si512(dst, _mm512_xor_si512(_mm512_loadu_si512(src), k));
+}
+#endif
+
+#ifdef __ARM_NEON
+static void xor_neon(uint8_t *dst, const uint8_t *src, unsigned long size, const uint8_t *key)
+{
+	const uint8x16_t k0 = vld1q_u8(key), k1 = vld1q_u8(key + 16);
+	const uint8x16_t k2 = vld1q_u8(key + 32), k3 = vld1q_u8(key + 48);
+	while (size >= 64) {
+		uint8x16_t v0 = vld1q_u8(src), v1 = vld1q_u8(src + 16);
+		uint8x16_t v2 = vld1q_u8(src + 32), v3 = vld1q_u8(src + 48);
+		vst1q_u8(dst, veorq_u8(v0, k0));
+		vst1q_u8(dst + 16, veorq_u8(v1, k1));
+		vst1q_u8(dst + 32, veorq_u8(v2, k2));
+		vst1q_u8(dst + 48, veorq_u8(v3, k3));
+		src += 64;
+		dst += 64;
+		size -= 64;
+	}
+}
+#endif
+
+static void (*xor_kernel)(uint8_t *dst, const uint8_t *src, unsigned long size, const uint8_t *key) = xor_scalar;
+
+// Select the kernel at load time, before any thread can call codec_xor()
+__attribute__((constructor))
+static void xor_init(void)
+{
+#if defined(CODEC_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		xor_kernel = xor_avx512;
+	else if (__builtin_cpu_supports("avx2"))
+		xor_kernel = xor_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		xor_kernel = xor_sse2;
+#elif defined(__ARM_NEON)
+	xor_kernel = xor_neon;
+#endif
+}
+
+unsigned long codec_xor(void *dst, const void *src, unsigned long size,
+		const void *pattern, unsigned long psize, unsigned long phase)
+{
+
+	uint8_t *pd = (uint8_t *)dst;
+	const uint8_t *ps = (const uint8_t *)src;
+	const uint8_t *pp = (const uint8_t *)pattern;
+	if (psize == 0) {
+		memmove(pd, ps, size);
+		return 0;
+	}
+	phase %= psize;
+
+	// Patterns that do not tile a cache line take the byte loop
+	if (64 % psize) {
+		while (size--) {
+			*pd++ = *ps++ ^ pp[phase];
+			if (++phase == psize)
+				phase = 0;
+		}
+		return phase;
+	}
+
+	// A whole number of patterns per line, so the key never changes
+	uint8_t key[64];
+	for (unsigned long i = 0, j = phase; i < sizeof(key); i++) {
+		key[i] = pp[j];
+		if (++j == psize)
+			j = 0;
+	}
+	unsigned long blocks = size & ~63UL;
+	xor_kernel(pd, ps, blocks, key);
+	for (unsigned long i = blocks; i < size; i++)
+		pd[i] = ps[i] ^ key[i - blocks];
+	return (phase + size) % psize;
+}
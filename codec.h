@@ -0,0 +1,33 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Swap every 2 bits of size bytes at p in place, used to encrypt and
+// decrypt upgrade.bin headers. Any size is accepted.
+void codec(void *p, unsigned long size);
+
+// XOR size bytes of src with a repeating pattern of psize bytes into dst,
+// starting at byte phase of the pattern. dst may equal src. Returns the
+// phase for the next call, so a stream can be decoded in any chunk sizes.
+unsigned long codec_xor(void *dst, const void *src, unsigned long size,
+		const void *pattern, unsigned long psize, unsigned long phase);
+
+// Bit-pair swap kernels codec() selects from, slowest first, for the
+// benchmark. supported is set at load time; the list ends with a null name.
+struct codec_kernel_t {
+	const char *name;
+	int supported;
+	void (*f)(uint8_t *p, unsigned long size);
+};
+extern struct codec_kernel_t codec_kernels[];
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <utility>
+#include <vector>
+#include "crc32.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_X86
+#endif
+
+// https://web.mit.edu/freebsd/head/sys/libkern/crc32.c
+const uint32_t crc32_tab[] = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+	0xe963a535, 0x9e6495a3,	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+	0xf3b97148, 0x84be41de,	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,	0x14015c4f, 0x63066cd9,
+	0xfa0f3d63, 0x8d080df5,	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,	0x35b5a8fa, 0x42b2986c,
+	0xdbbbc9d6, 0xacbcf940,	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,	0x76dc4190, 0x01db7106,
+	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+// Slicing-by-8 tables generated from crc32_tab, t[0] is crc32_tab itself
+static const struct crc32_tab8_t {
+	uint32_t t[8][256];
+	crc32_tab8_t()
+	{
+		for (int i = 0; i < 256; i++) {
+			uint32_t crc = crc32_tab[i];
+			t[0][i] = crc;
+			for (int k = 1; k < 8; k++) {
+				crc = crc32_tab[crc & 0xFF] ^ (crc >> 8);
+				t[k][i] = crc;
+			}
+		}
+	}
+} crc32_tab8;
+
+// Portable path, crc is the inverted running value
+static uint32_t crc32_sb8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	const uint32_t (*t)[256] = crc32_tab8.t;
+
+	// Process 8 bytes per iteration
+	while (size >= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+		      t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+		      t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+		      t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+	while (size--)
+		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC32_X86
+// Carry-less multiplication folding, from Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction". Each pair of constants is
+// bit-reflected (x^(d+32) mod P, x^(d-32) mod P) << 1 for fold distance d.
+alignas(16) static const uint64_t crc32_k2048[] = {0x011542778a, 0x01322d1430};
+alignas(16) static const uint64_t crc32_k512[] = {0x0154442bd4, 0x01c6e41596};
+alignas(16) static const uint64_t crc32_k128[] = {0x01751997d0, 0x00ccaa009e};
+alignas(16) static const uint64_t crc32_k64[] = {0x0163cd6124, 0x0000000000};
+alignas(16) static const uint64_t crc32_poly[] = {0x01db710641, 0x01f7011641};
+
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i crc32_fold(__m128i x, __m128i k, __m128i data)
+{
+	__m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+	__m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(lo, hi), data);
+}
+
+// Fold the four 128-bit accumulators over the rest of the buffer,
+// then reduce to 32 bits. size must be a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+static inline uint32_t crc32_reduce(__m128i x1, __m128i x2, __m128i x3, __m128i x4,
+		const uint8_t *p, size_t size)
+{
+	__m128i k = _mm_load_si128(reinterpret_cast<const __m128i *>(crc32_k512));
+	while (size >= 64) {
+		x1 = crc32_fold(x1, k, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00)));
+		x2 = crc32_fold(x2, k, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10)));
+		x3 = crc32_fold(x3, k, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20)));
+		x4 = crc32_fold(x4, k, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30)));
+		p += 64;
+		size -= 64;
+	}
+
+	// Fold into 128 bits
+	k = _mm_load_si128(reinterpret_cast<const __m128i *>(crc32_k128));
+	x1 = crc32_fold(x1, k, x2);
+	x1 = crc32_fold(x1, k, x3);
+	x1 = crc32_fold(x1, k, x4);
+	while (size >= 16) {
+		x1 = crc32_fold(x1, k, _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+		p += 16;
+		size -= 16;
+	}
+
+	// Fold 128 bits to 64 bits
+	__m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	k = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(crc32_k64));
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	k = _mm_load_si128(reinterpret_cast<const __m128i *>(crc32_poly));
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+
+// size must be at least 64 and a multiple of 16
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	__m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00));
+	__m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10));
+	__m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20));
+	__m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	return crc32_reduce(x1, x2, x3, x4, p + 64, size - 64);
+}
+
+__attribute__((target("avx512f,avx512vl,vpclmulqdq,pclmul,sse4.1")))
+static inline __m512i crc32_fold(__m512i x, __m512i k, __m512i data)
+{
+	__m512i lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+	__m512i hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+	return _mm512_ternarylogic_epi64(lo, hi, data, 0x96);
+}
+
+// Same as crc32_pclmul(), folding 256 bytes per iteration on 512-bit lanes
+__attribute__((target("avx512f,avx512vl,vpclmulqdq,pclmul,sse4.1")))
+static uint32_t crc32_vpclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	if (size < 256)
+		return crc32_pclmul(crc, p, size);
+
+	__m512i z1 = _mm512_loadu_si512(p + 0x00);
+	__m512i z2 = _mm512_loadu_si512(p + 0x40);
+	__m512i z3 = _mm512_loadu_si512(p + 0x80);
+	__m512i z4 = _mm512_loadu_si512(p + 0xc0);
+	z1 = _mm512_xor_si512(z1, _mm512_inserti32x4(_mm512_setzero_si512(), _mm_cvtsi32_si128(crc), 0));
+	p += 256;
+	size -= 256;
+
+	__m512i k = _mm512_set4_epi64(crc32_k2048[1], crc32_k2048[0], crc32_k2048[1], crc32_k2048[0]);
+	while (size >= 256) {
+		z1 = crc32_fold(z1, k, _mm512_loadu_si512(p + 0x00));
+		z2 = crc32_fold(z2, k, _mm512_loadu_si512(p + 0x40));
+		z3 = crc32_fold(z3, k, _mm512_loadu_si512(p + 0x80));
+		z4 = crc32_fold(z4, k, _mm512_loadu_si512(p + 0xc0));
+		p += 256;
+		size -= 256;
+	}
+
+	// Fold into a single 512-bit lane
+	k = _mm512_set4_epi64(crc32_k512[1], crc32_k512[0], crc32_k512[1], crc32_k512[0]);
+	z1 = crc32_fold(z1, k, z2);
+	z1 = crc32_fold(z1, k, z3);
+	z1 = crc32_fold(z1, k, z4);
+	return crc32_reduce(_mm512_extracti32x4_epi32(z1, 0), _mm512_extracti32x4_epi32(z1, 1),
+			_mm512_extracti32x4_epi32(z1, 2), _mm512_extracti32x4_epi32(z1, 3), p, size);
+}
+#endif
+
+// Whole buffer with a folding kernel, slicing-by-8 for the tail and
+// for buffers too short to fold
+template <uint32_t (*fold)(uint32_t crc, const uint8_t *p, size_t size)>
+static uint32_t crc32_with(uint32_t crc, const void *buf, size_t size)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(buf);
+
+	crc ^= ~0U;
+	if (fold && size >= 64) {
+		size_t s = size & ~static_cast<size_t>(15);
+		crc = fold(crc, p, s);
+		p += s;
+		size -= s;
+	}
+	crc = crc32_sb8(crc, p, size);
+	return crc ^ ~0U;
+}
+
+#ifdef CRC32_X86
+static bool crc32_cpu(bool vpclmul)
+{
+	__builtin_cpu_init();
+	if (vpclmul && !(__builtin_cpu_supports("vpclmulqdq") && __builtin_cpu_supports("avx512f") &&
+			__builtin_cpu_supports("avx512vl")))
+		return false;
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+const crc32_kernel_t crc32_kernels[] = {
+	{"slicing-by-8", true, crc32_with<nullptr>},
+#ifdef CRC32_X86
+	{"pclmul", crc32_cpu(false), crc32_with<crc32_pclmul>},
+	{"vpclmul", crc32_cpu(true), crc32_with<crc32_vpclmul>},
+#endif
+	{nullptr, false, nullptr},
+};
+
+uint32_t crc32(uint32_t crc, const void *buf, size_t size)
+{
+	// Fastest supported kernel, selected on first use from CPU features
+	static uint32_t (*const f)(uint32_t crc, const void *buf, size_t size) = [] {
+		uint32_t (*f)(uint32_t crc, const void *buf, size_t size) = crc32_with<nullptr>;
+		for (const crc32_kernel_t *k = crc32_kernels; k->name; k++)
+			if (k->supported)
+				f = k->f;
+		return f;
+	}();
+	return f(crc, buf, size);
+}
+
+// Multiply a and b modulo the reflected polynomial
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+	return p;
+}
+
+// x^(2^n) mod P for n = 0..31
+static const struct crc32_x2n_t {
+	uint32_t t[32];
+	crc32_x2n_t()
+	{
+		uint32_t p = 1U << 30;	// x^1
+		t[0] = p;
+		for (int n = 1; n < 32; n++)
+			t[n] = p = crc32_multmodp(p, p);
+	}
+} crc32_x2n;
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	// x^(8 * len2) mod P
+	uint32_t p = 1U << 31;
+	for (unsigned k = 3; len2; len2 >>= 1, k++)
+		if (len2 & 1)
+			p = crc32_multmodp(crc32_x2n.t[k & 31], p);
+	return crc32_multmodp(p, crc1) ^ crc2;
+}
+
+uint32_t crc32_split(size_t size, size_t align, unsigned long n, size_t min_chunk,
+		const std::function<uint32_t(size_t, size_t, size_t *)> &fcrc, size_t *plen)
+{
+	align = std::max<size_t>(1, align);
+	min_chunk = std::max<size_t>(1, min_chunk);
+	n = std::max(1UL, std::min<unsigned long>(n, (size + min_chunk - 1) / min_chunk));
+	size_t chunk = std::max<size_t>(1, ((size + n - 1) / n + align - 1) / align * align);
+	std::vector<std::future<std::pair<uint32_t, size_t>>> jobs;
+	for (size_t start = 0; start < size; start += chunk) {
+		size_t s = std::min(chunk, size - start);
+		jobs.push_back(std::async(n == 1 ? std::launch::deferred : std::launch::async, [=, &fcrc] {
+			size_t len = s;
+			uint32_t crc = fcrc(start, s, &len);
+			return std::make_pair(crc, len);
+		}));
+	}
+	uint32_t crc = 0;
+	size_t len = 0;
+	for (auto &job: jobs) {
+		auto r = job.get();
+		crc = crc32_combine(crc, r.first, r.second);
+		len += r.second;
+	}
+	if (plen)
+		*plen = len;
+	return crc;
+}
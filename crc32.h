@@ -0,0 +1,30 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// CRC-32 of size bytes at buf, continuing from crc, 0 for a new checksum
+uint32_t crc32(uint32_t crc, const void *buf, size_t size);
+
+// Combine crc1 of the first block with crc2 of the following block of len2 bytes
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+// Checksum size bytes as consecutive chunks cut on multiples of align, on up
+// to n threads but no more than one per min_chunk bytes. fcrc(start, size, &len) returns
+// the CRC of one chunk and the number of bytes it covered, chunks are merged
+// in order with crc32_combine(). The total covered length goes to plen.
+uint32_t crc32_split(size_t size, size_t align, unsigned long n, size_t min_chunk,
+		const std::function<uint32_t(size_t, size_t, size_t *)> &fcrc, size_t *plen);
+
+// Kernels crc32() selects from, slowest first, for the benchmark. Each
+// takes the arguments of crc32(); the list ends with a null name.
+struct crc32_kernel_t {
+	const char *name;
+	bool supported;
+	uint32_t (*f)(uint32_t crc, const void *buf, size_t size);
+};
+extern const crc32_kernel_t crc32_kernels[];
+
+#endif
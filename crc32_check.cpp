@@ -0,0 +1,138 @@
+// Check that split and threaded CRCs match the serial CRC for random sizes,
+// alignments and chunk sizes, including sizes that are not chunk multiples.
+// Then feed segment_crc_t raw, ubifs and NAND images in random chunks on
+// random thread counts and check it against a byte-wise reference.
+//   make check
+//   ./crc32_check [rounds] [max_size] [min_chunk]
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "crc32.h"
+#include "io.h"
+#include "segment_crc.h"
+
+// Segment checksum and checksummed length one record at a time: the LEB
+// of ubifs records unless all 0xff, the page of NAND records; records
+// shorter than 4 bytes are skipped
+static uint32_t segment_ref(uint32_t fstype, const geometry_t &geo, const uint8_t *p, size_t size, size_t &len)
+{
+	len = 0;
+	if (fstype != FsUbifs && fstype != FsRawNand) {
+		len = size;
+		return np_crc32(0, p, size);
+	}
+	unsigned long record = fstype == FsUbifs ? geo.leb + 4 : geo.page + geo.oob;
+	uint32_t crc = 0;
+	for (size_t s; size; p += s, size -= s) {
+		s = std::min<size_t>(record, size);
+		if (s < 4)
+			continue;
+		const uint8_t *d = fstype == FsUbifs ? p + 4 : p;
+		size_t n = fstype == FsUbifs ? s - 4 : std::min<size_t>(s, geo.page);
+		size_t i = 0;
+		while (fstype == FsUbifs && i < n && d[i] == 0xff)
+			i++;
+		if (fstype == FsUbifs && i == n)
+			continue;
+		crc = np_crc32(crc, d, n);
+		len += n;
+	}
+	return crc;
+}
+
+// Images of random records, ubifs LEBs erased, 0xff up to some point or
+// data throughout, fed in chunks from a few bytes to the whole image
+static unsigned long check_segments(std::mt19937_64 &rng, const std::vector<uint8_t> &random, unsigned long rounds)
+{
+	unsigned long failed = 0;
+	std::vector<uint8_t> image;
+	for (unsigned long i = 0; i < rounds; i++) {
+		static const uint32_t fstypes[] = {FsRaw, FsUbifs, FsRawNand};
+		uint32_t fstype = fstypes[rng() % 3];
+		geometry_t geo = {"check", 0, 0, 0, 512};
+		geo.leb = 1 + rng() % (rng() % 2 ? 64 : 256 * 1024);
+		geo.page = 1 + rng() % (rng() % 2 ? 64 : 4096);
+		geo.oob = rng() % 3 ? rng() % 256 : 0;
+		unsigned long record = fstype == FsUbifs ? geo.leb + 4 : fstype == FsRawNand ? geo.page + geo.oob : 4096;
+
+		// Up to 3 MiB, so whole records of large chunks go to worker threads
+		image.resize(rng() % std::min<size_t>(random.size(), 3 * 1024 * 1024 + 1));
+		for (size_t r = 0; r < image.size(); r += record) {
+			size_t s = std::min<size_t>(record, image.size() - r);
+			size_t prefix[] = {0, 4 + rng() % s, s};
+			size_t ff = prefix[rng() % 3];
+			size_t off = rng() % (random.size() - s);
+			for (size_t k = 0; k < s; k++)
+				image[r + k] = k < ff && k >= 4 ? 0xff : random[off + k];
+		}
+
+		threads = 1 + rng() % 8;
+		segment_crc_t sc(fstype, geo);
+		for (size_t pos = 0, s; pos < image.size(); pos += s) {
+			s = std::min<size_t>(image.size() - pos, 1 + rng() % (rng() % 4 ? 2 * record : image.size()));
+			sc.update(image.data() + pos, s);
+		}
+		unsigned long len;
+		uint32_t crc = sc.final(&len);
+		size_t rlen;
+		uint32_t ref = segment_ref(fstype, geo, image.data(), image.size(), rlen);
+		if (crc != ref || len != rlen) {
+			std::cerr << "Segment mismatch fstype=" << fstype << " size=" << image.size() << " leb=" << geo.leb
+				  << " page=" << geo.page << " oob=" << geo.oob << " threads=" << threads << std::hex
+				  << " crc=0x" << crc << " ref=0x" << ref << std::dec << " len=" << len << " ref=" << rlen << std::endl;
+			failed++;
+		}
+	}
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long rounds = argc > 1 ? std::stoul(argv[1], 0, 0) : 200;
+	size_t max_size = argc > 2 ? std::stoul(argv[2], 0, 0) : 4 * 1024 * 1024;
+	size_t min_chunk = argc > 3 ? std::stoul(argv[3], 0, 0) : 0;	// 0 for random
+
+	std::mt19937_64 rng(1);
+	std::vector<uint8_t> buf(max_size);
+	for (auto &b: buf)
+		b = rng();
+
+	unsigned long failed = 0;
+	for (unsigned long i = 0; i < rounds; i++) {
+		size_t size = rng() % (max_size + 1);
+		size_t align = rng() % 4 ? 1 + rng() % 4096 : 1;
+		size_t chunk = min_chunk ? min_chunk : 1 + rng() % (size / 3 + 1);
+		unsigned long n = 1 + rng() % 8;
+		const uint8_t *p = buf.data();
+
+		uint32_t serial = crc32(0, p, size);
+		size_t len = 0;
+		uint32_t split = crc32_split(size, align, n, chunk, [&](size_t start, size_t s, size_t *plen) {
+			*plen = s;
+			return crc32(0, p + start, s);
+		}, &len);
+
+		// Raw CRC without pre and post inversion, as segment checksums use
+		uint32_t raw = ~crc32(~0U, p, size);
+		uint32_t rsplit = crc32_split(size, align, n, chunk, [&](size_t start, size_t s, size_t *plen) {
+			*plen = s;
+			return ~crc32(~0U, p + start, s);
+		}, nullptr);
+
+		if (split != serial || len != size || rsplit != raw) {
+			std::cerr << "Mismatch size=" << size << " align=" << align << " min_chunk=" << chunk
+				  << " threads=" << n << std::hex << " serial=0x" << serial << " split=0x" << split
+				  << " raw=0x" << raw << " rsplit=0x" << rsplit << std::dec << std::endl;
+			failed++;
+		}
+	}
+	std::cout << rounds - failed << "/" << rounds << " ok" << std::endl;
+
+	unsigned long sfailed = check_segments(rng, buf, rounds);
+	std::cout << rounds - sfailed << "/" << rounds << " segments ok" << std::endl;
+	return failed || sfailed ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "codec.h"
+#include "inflate.h"
+#include "io.h"
+
+#ifdef USE_LIBDEFLATE
+// Inflate whole compressed chunks with libdeflate, buffers grow to the
+// largest chunk
+zlib_inflater_t::zlib_inflater_t(): d(libdeflate_alloc_decompressor())
+{
+	if (!d)
+		throw std::runtime_error("zlib inflate init error: " + std::string(zError(Z_MEM_ERROR)));
+}
+
+zlib_inflater_t::~zlib_inflater_t()
+{
+	libdeflate_free_decompressor(d);
+}
+
+void zlib_inflater_t::inflate(const uint8_t *pz, uint32_t zsize, uint32_t usize, const void *px, uint32_t xsize,
+		const std::function<void(const void *, unsigned long)> &fdata)
+{
+	if (px) {
+		if (zbuf.size() < zsize)
+			zbuf.resize(zsize);
+		codec_xor(zbuf.data(), pz, zsize, px, xsize, 0);
+		pz = zbuf.data();
+	}
+	if (ubuf.size() < usize)
+		ubuf.resize(usize);
+
+	// Detect gzip or zlib
+	size_t zin = 0, uout = 0;
+	libdeflate_result err;
+	if (zsize >= 2 && pz[0] == 0x1f && pz[1] == 0x8b)
+		err = libdeflate_gzip_decompress_ex(d, pz, zsize, ubuf.data(), usize, &zin, &uout);
+	else
+		err = libdeflate_zlib_decompress_ex(d, pz, zsize, ubuf.data(), usize, &zin, &uout);
+	if (err != LIBDEFLATE_SUCCESS)
+		throw std::runtime_error("zlib inflate error: " + std::string(zError(zlib_error(pz, zsize, usize))));
+	if (zin != zsize)
+		throw std::runtime_error("zlib compressed size mismatch: " + std::to_string(zin) +
+				" should be " + std::to_string(zsize));
+	if (uout != usize)
+		throw std::runtime_error("zlib uncompressed size mismatch: " + std::to_string(uout) +
+				" should be " + std::to_string(usize));
+	fdata(ubuf.data(), uout);
+}
+
+// libdeflate reports truncated input as bad data, so run zlib over
+// a failed chunk for the error it gives without libdeflate
+int zlib_inflater_t::zlib_error(const uint8_t *pz, uint32_t zsize, uint32_t usize)
+{
+	z_stream strm = {};
+	int err = inflateInit2(&strm, 32 + MAX_WBITS);
+	if (err == Z_OK) {
+		strm.next_in   = const_cast<Bytef *>(pz);
+		strm.avail_in  = zsize;
+		strm.next_out  = ubuf.data();
+		strm.avail_out = usize;
+		err = ::inflate(&strm, Z_FINISH);
+		inflateEnd(&strm);
+	}
+	return err == Z_OK || err == Z_STREAM_END ? Z_DATA_ERROR : err;
+}
+#else
+// Inflate compressed chunks through two block_size windows, so memory
+// stays bounded whatever the chunk sizes. One z_stream is reset per chunk.
+zlib_inflater_t::zlib_inflater_t(): zbuf(buffer_get()), ubuf(buffer_get())
+{
+	strm.next_in  = Z_NULL;
+	strm.avail_in = 0;
+	strm.zalloc   = Z_NULL;
+	strm.zfree    = Z_NULL;
+	strm.opaque   = Z_NULL;
+
+	// +32: Detect gzip or zlib
+	int err = inflateInit2(&strm, 32 + MAX_WBITS);
+	if (err != Z_OK) {
+		inflateEnd(&strm);
+		throw std::runtime_error("zlib inflate init error: " + std::string(zError(err)));
+	}
+}
+
+zlib_inflater_t::~zlib_inflater_t()
+{
+	inflateEnd(&strm);
+}
+
+void zlib_inflater_t::inflate(const uint8_t *pz, uint32_t zsize, uint32_t usize, const void *px, uint32_t xsize,
+		const std::function<void(const void *, unsigned long)> &fdata)
+{
+	int err = inflateReset(&strm);
+	if (err != Z_OK)
+		throw std::runtime_error("zlib inflate reset error: " + std::string(zError(err)));
+	// Reset keeps input left over by a failed chunk
+	strm.next_in  = Z_NULL;
+	strm.avail_in = 0;
+
+	unsigned long zpos = 0, phase = 0;
+	while (err == Z_OK) {
+		// Refill input window
+		if (strm.avail_in == 0 && zpos < zsize) {
+			unsigned long s = std::min(zsize - zpos, block_size);
+			if (px) {
+				phase = codec_xor(zbuf.get(), pz + zpos, s, px, xsize, phase);
+				strm.next_in = zbuf.get();
+			} else {
+				strm.next_in = const_cast<Bytef *>(pz + zpos);
+			}
+			strm.avail_in = s;
+			zpos += s;
+		}
+
+		// Output window, never past usize
+		strm.next_out  = ubuf.get();
+		strm.avail_out = std::min(usize - strm.total_out, block_size);
+
+		err = ::inflate(&strm, Z_NO_FLUSH);
+		unsigned long have = strm.next_out - ubuf.get();
+		if (have)
+			fdata(ubuf.get(), have);
+	}
+	// Buffer error: truncated data or output larger than usize
+	if (err != Z_STREAM_END)
+		throw std::runtime_error("zlib inflate error: " + std::string(zError(err)));
+	if (strm.total_in != zsize)
+		throw std::runtime_error("zlib compressed size mismatch: " + std::to_string(strm.total_in) +
+				" should be " + std::to_string(zsize));
+	if (strm.total_out != usize)
+		throw std::runtime_error("zlib uncompressed size mismatch: " + std::to_string(strm.total_out) +
+				" should be " + std::to_string(usize));
+}
+#endif
@@ -0,0 +1,39 @@
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <zlib.h>
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+// Inflater for NP890 compressed chunks, zlib or gzip, with the backend
+// chosen by INFLATE in the Makefile. Errors are reported in zlib terms
+// whichever backend is built in. One per thread, reused across chunks.
+class zlib_inflater_t
+{
+public:
+	zlib_inflater_t();
+	~zlib_inflater_t();
+
+	// Inflate zsize bytes at pz, XOR decoded with px first if set,
+	// into exactly usize bytes passed to fdata in order
+	void inflate(const uint8_t *pz, uint32_t zsize, uint32_t usize, const void *px, uint32_t xsize,
+			const std::function<void(const void *, unsigned long)> &fdata);
+
+private:
+#ifdef USE_LIBDEFLATE
+	int zlib_error(const uint8_t *pz, uint32_t zsize, uint32_t usize);
+
+	libdeflate_decompressor *d;
+	std::vector<uint8_t> zbuf, ubuf;
+#else
+	z_stream strm;
+	std::shared_ptr<uint8_t> zbuf, ubuf;
+#endif
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "codec.h"
 
 #pragma pack(push, 1)
 struct header_t {
@@ -33,21 +34,6 @@ struct header_t {
 
 static char strbuf[64];
 
-void codec(void *p, unsigned long size)
-{
-	if (size % 8) {
-		fprintf(stderr, "Unexpected codec block size %d\n", size);
-		exit(1);
-	}
-	uint64_t *pv = (uint64_t *)p;
-	while (size) {
-		uint64_t v = *pv;
-		// Swap every 2 bits
-		*pv++ = ((v & 0xaaaaaaaaaaaaaaaa) >> 1) | ((v & 0x5555555555555555) << 1);
-		size -= 8;
-	}
-}
-
 const char *fstype(uint32_t v)
 {
 	static const char *pfstype[] = {
@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "io.h"
+
+// Settings from the command line
+unsigned long threads = 0;	// Worker threads for checksums, 0 for all cores
+unsigned long jobs = 1;		// Segments processed in parallel
+bool zero_copy = true;		// Use copy_file_range() where supported
+unsigned long block_size = 4 * 1024 * 1024;	// I/O buffer size, default 4MiB
+std::string geometry_file;	// Device geometry additions and overrides
+bool seg_cache = true;		// Reuse unchanged segments of the previous output
+
+// Bytes copied by copy(), inside the kernel and through user space
+std::atomic<unsigned long> copied_zero(0), copied_buffered(0);
+
+// Free I/O buffers of block_size bytes, reused across calls and threads
+static std::vector<uint8_t *> buffer_pool;
+static std::mutex buffer_lock;
+
+// Get a page aligned buffer of block_size bytes from the pool,
+// it goes back to the pool with the last reference
+std::shared_ptr<uint8_t> buffer_get()
+{
+	uint8_t *p = nullptr;
+	{
+		std::lock_guard<std::mutex> guard(buffer_lock);
+		if (!buffer_pool.empty()) {
+			p = buffer_pool.back();
+			buffer_pool.pop_back();
+		}
+	}
+	void *pa;
+	if (!p && posix_memalign(&pa, 4096, block_size) != 0)
+		throw std::runtime_error("Could not allocate I/O buffer of " + std::to_string(block_size) + " bytes");
+	else if (!p)
+		p = static_cast<uint8_t *>(pa);
+	return std::shared_ptr<uint8_t>(p, [](uint8_t *p) {
+		std::lock_guard<std::mutex> guard(buffer_lock);
+		buffer_pool.push_back(p);
+	});
+}
+
+// Write all size bytes of buf at offset of fd
+void pwrite_full(int fd, const void *buf, unsigned long size, unsigned long offset)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(buf);
+	while (size) {
+		ssize_t s = pwrite(fd, p, size, offset);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s <= 0)
+			throw std::runtime_error("Write error at offset " + std::to_string(offset) + ": " + strerror(errno));
+		p += s;
+		offset += s;
+		size -= s;
+	}
+}
+
+// Read up to size bytes from fd, short only at EOF. Returns bytes read.
+unsigned long read_full(int fd, void *buf, unsigned long size)
+{
+	uint8_t *p = static_cast<uint8_t *>(buf);
+	unsigned long done = 0;
+	while (done < size) {
+		ssize_t s = read(fd, p + done, size - done);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s < 0)
+			throw std::runtime_error(std::string("Read error: ") + strerror(errno));
+		if (s == 0)
+			break;
+		done += s;
+	}
+	return done;
+}
+
+// Input that can only be read forward: "-" for stdin, pipes and sockets
+bool input_stream(const std::string &path)
+{
+	struct stat st;
+	if (path == "-")
+		return true;
+	return stat(path.c_str(), &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode));
+}
+
+// Open input for reading forward, the caller closes the fd
+int open_stream(const std::string &path)
+{
+	int fd = path == "-" ? dup(STDIN_FILENO) : open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Could not open input file " + path);
+	return fd;
+}
+
+// Nanoseconds since the epoch of a stat timestamp
+unsigned long stat_ns(const struct timespec &ts)
+{
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Size and mtime of path as "size mtime_ns", empty if it cannot be stat'ed.
+// Sidecar files start with it to notice changes to the file they describe.
+std::string file_stamp(const std::string &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return std::string();
+	return std::to_string(st.st_size) + " " + std::to_string(stat_ns(st.st_mtim));
+}
+
+// Map whole file read-only, the mapping is released with the last reference
+std::shared_ptr<const uint8_t> map_file(const std::string &path, unsigned long &size)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Could not open input file " + path);
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		throw std::runtime_error("Could not stat input file " + path);
+	}
+	unsigned long msize = size = st.st_size;
+	void *p = msize ? mmap(nullptr, msize, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+	close(fd);
+	if (p == MAP_FAILED)
+		throw std::runtime_error("Could not map input file " + path + ": " + strerror(errno));
+	return std::shared_ptr<const uint8_t>(static_cast<const uint8_t *>(p), [msize](const uint8_t *p) {
+		if (p)
+			munmap(const_cast<uint8_t *>(p), msize);
+	});
+}
+
+// Access pattern hint for [p, p + size) of a mapping
+void map_advise(const void *p, unsigned long size, int advice)
+{
+	static const unsigned long pgsize = sysconf(_SC_PAGESIZE);
+	uintptr_t start = reinterpret_cast<uintptr_t>(p);
+	uintptr_t base = start / pgsize * pgsize;
+	if (size)
+		madvise(reinterpret_cast<void *>(base), start + size - base, advice);
+}
+
+static const unsigned long map_window = 64 * 1024 * 1024;	// Map 64MiB at a time
+
+// Pass size bytes at offset of fd to fdata through read-only mappings
+static void mmap_data(int fd, unsigned long offset, unsigned long size,
+		const std::function<void(const void *, unsigned long)> &fdata)
+{
+	static const unsigned long pgsize = sysconf(_SC_PAGESIZE);
+	while (size) {
+		unsigned long base = offset / pgsize * pgsize;
+		unsigned long s = std::min(map_window, size);
+		unsigned long msize = offset - base + s;
+		void *p = mmap(nullptr, msize, PROT_READ, MAP_SHARED, fd, base);
+		if (p == MAP_FAILED)
+			throw std::runtime_error("Could not map input at offset " + std::to_string(offset) + ": " + strerror(errno));
+		madvise(p, msize, MADV_SEQUENTIAL);
+		fdata(static_cast<uint8_t *>(p) + (offset - base), s);
+		munmap(p, msize);
+		offset += s;
+		size -= s;
+	}
+}
+
+// Copy size bytes from offset of in to offset of out, padding the output to
+// align bytes. Safe to use from multiple threads sharing the same fds.
+// copy_file_range() keeps the data in the kernel (and shares extents on
+// filesystems with reflink support); whatever it cannot copy goes through
+// a user space buffer. fdata sees all data in order, from a read-only
+// mapping of the input for the part copied in the kernel. That part is
+// copied and passed to fdata a window at a time, so fdata reads each
+// window while it is still in the page cache.
+void copy(int out, unsigned long outoff, int in, unsigned long inoff,
+		unsigned long size, unsigned long align,
+		const std::function<void(const void *, unsigned long)> &fdata)
+{
+	unsigned long padding = (align - (size % align)) % align;
+
+	if (zero_copy) {
+		loff_t rin = inoff, rout = outoff;
+		while (size) {
+			unsigned long window = std::min(map_window, size), done = 0;
+			while (done < window) {
+				ssize_t s = copy_file_range(in, &rin, out, &rout, window - done, 0);
+				if (s < 0 && errno == EINTR)
+					continue;
+				if (s <= 0)
+					break;		// Not supported here, or EOF
+				done += s;
+			}
+			if (done && fdata)
+				mmap_data(in, inoff, done, fdata);
+			copied_zero += done;
+			inoff += done;
+			outoff += done;
+			size -= done;
+			if (done < window)
+				break;
+		}
+	}
+
+	if (!size && !padding)
+		return;
+	auto pbuf = buffer_get();
+	uint8_t *buf = pbuf.get();
+	copied_buffered += size;
+	while (size) {
+		ssize_t s = pread(in, buf, std::min(block_size, size), inoff);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s < 0)
+			throw std::runtime_error("Read error at offset " + std::to_string(inoff) + ": " + strerror(errno));
+		if (s == 0)
+			throw std::runtime_error("Unexpected EOF at offset " + std::to_string(inoff));
+		if (fdata)
+			fdata(buf, s);
+		pwrite_full(out, buf, s, outoff);
+		inoff += s;
+		outoff += s;
+		size -= s;
+	}
+	// Alignment from --geometry may exceed the buffer, pad a block at a time
+	bzero(buf, std::min(block_size, padding));
+	while (padding) {
+		unsigned long s = std::min(block_size, padding);
+		pwrite_full(out, buf, s, outoff);
+		outoff += s;
+		padding -= s;
+	}
+}
+
+// Run f(0) to f(n - 1) on up to jobs threads,
+// stop at the first exception and rethrow it
+void parallel_for(unsigned long n, unsigned long jobs, const std::function<void(unsigned long)> &f)
+{
+	if (jobs <= 1 || n <= 1) {
+		for (unsigned long i = 0; i < n; i++)
+			f(i);
+		return;
+	}
+
+	std::atomic<unsigned long> next(0);
+	std::exception_ptr err;
+	std::mutex lock;
+	auto worker = [&] {
+		for (unsigned long i; (i = next++) < n;) {
+			try {
+				f(i);
+			} catch (...) {
+				std::lock_guard<std::mutex> guard(lock);
+				if (!err)
+					err = std::current_exception();
+				next = n;
+			}
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned long i = std::min(jobs, n); i--;)
+		workers.emplace_back(worker);
+	for (auto &t: workers)
+		t.join();
+	if (err)
+		std::rethrow_exception(err);
+}
+
+// Parse a whole string as a number in C notation
+bool parse_number(const std::string &s, unsigned long &v)
+{
+	char *end;
+	errno = 0;
+	v = strtoul(s.c_str(), &end, 0);
+	return !s.empty() && !*end && errno == 0;
+}
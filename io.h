@@ -0,0 +1,35 @@
+#ifndef IO_H
+#define IO_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <time.h>
+
+// Settings from the command line and copy() statistics, see io.cpp
+extern unsigned long threads;
+extern unsigned long jobs;
+extern bool zero_copy;
+extern unsigned long block_size;
+extern std::string geometry_file;
+extern bool seg_cache;
+extern std::atomic<unsigned long> copied_zero, copied_buffered;
+
+std::shared_ptr<uint8_t> buffer_get();
+void pwrite_full(int fd, const void *buf, unsigned long size, unsigned long offset);
+unsigned long read_full(int fd, void *buf, unsigned long size);
+bool input_stream(const std::string &path);
+int open_stream(const std::string &path);
+unsigned long stat_ns(const struct timespec &ts);
+std::string file_stamp(const std::string &path);
+std::shared_ptr<const uint8_t> map_file(const std::string &path, unsigned long &size);
+void map_advise(const void *p, unsigned long size, int advice);
+void copy(int out, unsigned long outoff, int in, unsigned long inoff,
+		unsigned long size, unsigned long align,
+		const std::function<void(const void *, unsigned long)> &fdata = nullptr);
+void parallel_for(unsigned long n, unsigned long jobs, const std::function<void(unsigned long)> &f);
+bool parse_number(const std::string &s, unsigned long &v);
+
+#endif
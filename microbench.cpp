@@ -0,0 +1,355 @@
+// Throughput of each dispatched kernel against the code it replaced, linked
+// with the same objects as mkpkg. Every section first checks its kernels
+// against a reference and stops at the first mismatch.
+//   make bench
+//   ./microbench [crc32|codec|inflate|unmap]...
+//   make -B microbench INFLATE=libdeflate && ./microbench inflate
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include "codec.h"
+#include "crc32.h"
+#include "inflate.h"
+#include "segment_crc.h"
+
+// Results of timed calls go here, so they are not optimised away
+static volatile uint32_t sink;
+
+// GB/s of size bytes per call of f, called for at least half a second
+static double rate(unsigned long size, const std::function<void()> &f)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	double s = 0;
+	unsigned long bytes = 0;
+	while (s < 0.5) {
+		f();
+		bytes += size;
+		s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	}
+	return bytes / s / 1e9;
+}
+
+// Byte at a time from a table, as crc32() was before slicing-by-8
+static uint32_t crc32_byte(uint32_t crc, const void *buf, size_t size)
+{
+	static const struct tab_t {
+		uint32_t t[256];
+		tab_t()
+		{
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+				t[i] = c;
+			}
+		}
+	} tab;
+	const uint8_t *p = static_cast<const uint8_t *>(buf);
+
+	crc ^= ~0U;
+	while (size--)
+		crc = tab.t[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc ^ ~0U;
+}
+
+static bool bench_crc32()
+{
+	const size_t size = 64 << 20;
+	std::mt19937_64 rng(1);
+	std::vector<uint8_t> buf(size + 64);
+	for (auto &b: buf)
+		b = rng();
+
+	printf("crc32 of %zu MiB, GB/s\n", size >> 20);
+	printf("%-14s %6.2f\n", "byte loop", rate(size, [&] { sink = crc32_byte(0, buf.data(), size); }));
+	for (const crc32_kernel_t *k = crc32_kernels; k->name; k++) {
+		if (!k->supported) {
+			printf("%-14s %6s\n", k->name, "-");
+			continue;
+		}
+		for (int i = 0; i < 20000; i++) {
+			size_t off = rng() % 64, n = rng() % (i < 19000 ? 1100 : 200000);
+			uint32_t seed = rng();
+			if (k->f(seed, buf.data() + off, n) != crc32_byte(seed, buf.data() + off, n)) {
+				printf("%s: mismatch at offset %zu size %zu\n", k->name, off, n);
+				return false;
+			}
+		}
+		printf("%-14s %6.2f\n", k->name, rate(size, [&] { sink = k->f(0, buf.data(), size); }));
+	}
+	return true;
+}
+
+// One byte at a time
+static void codec_byte(uint8_t *p, unsigned long size)
+{
+	while (size--) {
+		*p = ((*p & 0xaa) >> 1) | ((*p & 0x55) << 1);
+		p++;
+	}
+}
+
+// 64 bits at a time without a tail, as codec() was before the SIMD kernels
+static void codec_old(uint8_t *p, unsigned long size)
+{
+	uint64_t *pv = reinterpret_cast<uint64_t *>(p);
+	for (size /= 8; size--; pv++)
+		*pv = ((*pv & 0xaaaaaaaaaaaaaaaaULL) >> 1) | ((*pv & 0x5555555555555555ULL) << 1);
+}
+
+// Bit-pair swap in place on an L1 resident buffer
+static bool bench_codec()
+{
+	static uint64_t buf[16 * 1024 / 8];
+	const unsigned long size = sizeof(buf);
+	uint8_t *p = reinterpret_cast<uint8_t *>(buf);
+	std::vector<uint8_t> a(4096 + 192), b(a.size());
+	std::mt19937 rng(1);
+
+	printf("codec of %lu KiB, GB/s\n", size >> 10);
+	printf("%-14s %6.2f\n", "old loop", rate(size, [&] { codec_old(p, size); sink = p[0]; }));
+	for (const codec_kernel_t *k = codec_kernels; k->name; k++) {
+		if (!k->supported) {
+			printf("%-14s %6s\n", k->name, "-");
+			continue;
+		}
+		for (int t = 0; t < 5000; t++) {
+			unsigned long off = rng() % 64, n = rng() % 4096;
+			for (auto &v: a)
+				v = rng();
+			b = a;
+			k->f(a.data() + off, n);
+			codec_byte(b.data() + off, n);
+			if (a != b) {
+				printf("%s: mismatch at offset %lu size %lu\n", k->name, off, n);
+				return false;
+			}
+		}
+		printf("%-14s %6.2f\n", k->name, rate(size, [&] { k->f(p, size); sink = p[0]; }));
+	}
+	return true;
+}
+
+// Inflate a chunk, returning the output or the error message
+static std::string inflate_chunk(zlib_inflater_t &zinf, const std::vector<uint8_t> &z,
+		unsigned long zsize, unsigned long usize, const std::vector<uint8_t> &pattern = {})
+{
+	std::string out;
+	try {
+		zinf.inflate(z.data(), zsize, usize, pattern.empty() ? nullptr : pattern.data(), pattern.size(),
+				[&](const void *p, unsigned long s) { out.append(static_cast<const char *>(p), s); });
+	} catch (std::exception &e) {
+		return std::string("error: ") + e.what();
+	}
+	return out;
+}
+
+// NP890 chunk inflation with the backend selected by INFLATE, on
+// text-like chunks compressed at level 9 as the vendor images are
+static bool bench_inflate()
+{
+	const unsigned long n = 64, usize = 1 << 20;
+	std::mt19937 rng(1);
+
+	static const char *words[] = {"alpha", "beta", "gamma", "delta", "/usr/lib/libc.so.6", "\x7f" "ELF"};
+	std::vector<std::string> u(n);
+	std::vector<std::vector<uint8_t>> z(n);
+	unsigned long ztotal = 0;
+	for (unsigned long c = 0; c < n; c++) {
+		while (u[c].size() < usize) {
+			if (rng() % 4 == 0)
+				u[c] += char(rng());
+			else
+				u[c] += words[rng() % 6];
+		}
+		u[c].resize(usize);
+		uLongf zsize = compressBound(usize);
+		z[c].resize(zsize);
+		if (compress2(z[c].data(), &zsize, reinterpret_cast<const Bytef *>(u[c].data()), usize, 9) != Z_OK) {
+			printf("compress2 failed\n");
+			return false;
+		}
+		z[c].resize(zsize);
+		ztotal += zsize;
+	}
+
+#ifdef USE_LIBDEFLATE
+	const char *backend = "libdeflate";
+#else
+	const char *backend = "zlib";
+#endif
+	zlib_inflater_t zinf;
+
+	// Output and XOR decoding
+	std::vector<uint8_t> pattern(4099), zx(z[0]);
+	for (auto &b: pattern)
+		b = rng();
+	codec_xor(zx.data(), zx.data(), zx.size(), pattern.data(), pattern.size(), 0);
+	if (inflate_chunk(zinf, z[0], z[0].size(), usize) != u[0] ||
+			inflate_chunk(zinf, zx, zx.size(), usize, pattern) != u[0]) {
+		printf("%s: output mismatch\n", backend);
+		return false;
+	}
+
+	// Broken chunks report the same errors with either backend
+	std::vector<uint8_t> zh(z[0]), za(z[0]), zt(z[0]);
+	zh[0] ^= 0xff;
+	za.back() ^= 0xff;
+	zt.push_back(0);
+	const struct {
+		const char *name;
+		const std::vector<uint8_t> &z;
+		unsigned long zsize, usize;
+		std::string error;
+	} broken[] = {
+		{"bad header", zh, zh.size(), usize, "zlib inflate error: data error"},
+		{"bad adler32", za, za.size(), usize, "zlib inflate error: data error"},
+		{"truncated", z[0], z[0].size() - 16, usize, "zlib inflate error: buffer error"},
+		{"trailing byte", zt, zt.size(), usize, "zlib compressed size mismatch: " +
+				std::to_string(z[0].size()) + " should be " + std::to_string(zt.size())},
+		{"output too small", z[0], z[0].size(), usize - 1, "zlib inflate error: buffer error"},
+		{"output too large", z[0], z[0].size(), usize + 1, "zlib uncompressed size mismatch: " +
+				std::to_string(usize) + " should be " + std::to_string(usize + 1)},
+	};
+	for (auto &b: broken) {
+		std::string r = inflate_chunk(zinf, b.z, b.zsize, b.usize);
+		if (r != std::string("error: ") + b.error) {
+			printf("%s: %s chunk: %s\n", backend, b.name, r.compare(0, 7, "error: ") ? "no error" : r.c_str());
+			return false;
+		}
+	}
+
+	printf("inflate of %lu x %lu KiB chunks, ratio %.2f, GB/s\n", n, usize >> 10, double(ztotal) / (n * usize));
+	printf("%-14s %6.2f\n", backend, rate(n * usize, [&] {
+		for (unsigned long c = 0; c < n; c++)
+			zinf.inflate(z[c].data(), z[c].size(), usize, nullptr, 0, [](const void *, unsigned long) {});
+	}));
+	return true;
+}
+
+// Checksum each LEB unless all bytes are 0xff, checked a byte at a time,
+// as np_crc32_ubifs() was before the scan was fused with the checksum
+static uint32_t ubifs_crc32_old(const uint8_t *p, unsigned long size, unsigned long leb)
+{
+	uint32_t crc = 0;
+	while (size >= 4) {
+		unsigned long s = std::min(leb + 4, size);
+		unsigned long i = 4;
+		while (i < s && p[i] == 0xff)
+			i++;
+		if (i < s)
+			crc = np_crc32(crc, p + 4, s - 4);
+		p += s;
+		size -= s;
+	}
+	return crc;
+}
+
+// ubifs segment checksum with each erased LEB scan kernel, on images from
+// all erased to dense LEBs
+static bool bench_unmap()
+{
+	const unsigned long lebs = 256;
+	const geometry_t geo = {"bench", 504 * 1024, 0, 0, 512};
+	const unsigned long record = geo.leb + 4, size = lebs * record;
+	std::mt19937 rng(1);
+
+	// Kernels agree with the scalar one on random 0xff runs at any alignment
+	std::vector<uint8_t> buf(4096 + 64);
+	for (const unmap_kernel_t *k = unmap_kernels; k->name; k++) {
+		if (!k->supported)
+			continue;
+		for (int t = 0; t < 20000; t++) {
+			unsigned long off = rng() % 64, n = rng() % 4096, ff = rng() % (n + 1);
+			for (unsigned long i = 0; i < n; i++)
+				buf[off + i] = i < ff ? 0xff : rng();
+			unsigned long r = unmap_kernels[0].f(buf.data() + off, n);
+			if (k->f(buf.data() + off, n) != r || r < ff) {
+				printf("%s: mismatch at offset %lu size %lu\n", k->name, off, n);
+				return false;
+			}
+		}
+	}
+
+	// Share of erased LEBs, sparse images are mostly erased. Data LEBs
+	// hold nodes from the start, padded with 0xff to the end.
+	static const struct {
+		const char *name;
+		unsigned percent;
+	} patterns[] = {{"erased", 100}, {"sparse", 90}, {"half", 50}, {"dense", 0}};
+	std::vector<uint8_t> image(size);
+	printf("unmap of %lu LEBs of %lu KiB, GB/s\n%-11s %8s", lebs, geo.leb >> 10, "erased", "old");
+	for (const unmap_kernel_t *k = unmap_kernels; k->name; k++)
+		printf(" %8s", k->name);
+	printf("\n");
+	for (auto &p: patterns) {
+		for (unsigned long l = 0; l < lebs; l++) {
+			uint8_t *r = image.data() + l * record;
+			unsigned long data = rng() % 100 < p.percent ? 0 : geo.leb / 2 + rng() % (geo.leb / 2);
+			for (unsigned long i = 0; i < record; i++)
+				r[i] = i < 4 || i - 4 < data ? rng() : 0xff;
+		}
+		uint32_t old = ubifs_crc32_old(image.data(), size, geo.leb);
+
+		printf("%-6s %3u%% %8.2f", p.name, p.percent,
+				rate(size, [&] { sink = ubifs_crc32_old(image.data(), size, geo.leb); }));
+		for (const unmap_kernel_t *k = unmap_kernels; k->name; k++) {
+			if (!k->supported) {
+				printf(" %8s", "-");
+				continue;
+			}
+			segment_crc_t sc(FsUbifs, geo, k->f);
+			sc.update(image.data(), size);
+			uint32_t crc = sc.final();
+			if (crc != old) {
+				printf("\n%s: %u%% erased checksum %08x should be %08x\n", k->name, p.percent, crc, old);
+				return false;
+			}
+			printf(" %8.2f", rate(size, [&] {
+				segment_crc_t c(FsUbifs, geo, k->f);
+				c.update(image.data(), size);
+				sink = c.final();
+			}));
+		}
+		printf("\n");
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		bool (*f)();
+	} sections[] = {
+		{"crc32", bench_crc32},
+		{"codec", bench_codec},
+		{"inflate", bench_inflate},
+		{"unmap", bench_unmap},
+	};
+
+	std::vector<std::string> run(argv + 1, argv + argc);
+	for (auto &r: run) {
+		bool known = false;
+		for (auto &s: sections)
+			known |= r == s.name;
+		if (!known) {
+			fprintf(stderr, "Unknown benchmark %s\n", r.c_str());
+			return 2;
+		}
+	}
+	for (auto &s: sections) {
+		if (!run.empty() && std::find(run.begin(), run.end(), s.name) == run.end())
+			continue;
+		if (!s.f())
+			return 1;
+	}
+	return 0;
+}
@@ -6,8 +6,22 @@
 #include <sstream>
 #include <stdexcept>
 #include <cstdint>
+#include <climits>
 #include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "codec.h"
+#include "crc32.h"
+#include "io.h"
+#include "segment_crc.h"
 
 #pragma pack(push, 1)
 struct header_t {
@@ -32,45 +46,108 @@ struct header_t {
 };
 #pragma pack(pop)
 
-enum {
-	FsNone,
-	FsMsdos,
-	FsUnknown2,
-	FsYaffs,
-	FsRawNand,
-	FsUnknown5,
-	FsRaw,
-	FsNor,
-	FsUbifs,
-} fs_type_t;
-
-void copy(std::ofstream &out, std::ifstream &in, unsigned long size, unsigned long align);
-uint32_t crc32(uint32_t crc, const void *buf, size_t size);
-
-static unsigned long tag_ubifs_leb_size(const char *tag)
+// 8-byte device tag as a number that sorts like the string
+static constexpr uint64_t tag_key(const char *tag, unsigned i = 0)
 {
-	if (strcmp(tag, "np1300") == 0)
-		return 252 * 1024;
-	else if (strcmp(tag, "np1500") == 0)
-		return 252 * 1024;
-	else if (strcmp(tag, "np1501") == 0)
-		return 504 * 1024;
-	else if (strcmp(tag, "np1380") == 0)
-		return 504 * 1024;
-	else if (strcmp(tag, "np2150") == 0)
-		return 504 * 1024;
-	//throw std::runtime_error("Unknown ubifs LEB size for " + std::string(tag));
-	return 252 * 1024;
+	return i == 8 || !tag[i] ? 0 :
+		(static_cast<uint64_t>(static_cast<uint8_t>(tag[i])) << (56 - 8 * i)) | tag_key(tag, i + 1);
 }
 
-static void tag_nand_size(const char *tag, unsigned long &page, unsigned long &oob)
+// Known devices, sorted by tag
+static constexpr geometry_t geometries[] = {
+	{"np1100",          0, 2048, 64, 512},
+	{"np1300", 252 * 1024,    0,  0, 512},
+	{"np1380", 504 * 1024,    0,  0, 512},
+	{"np1500", 252 * 1024,    0,  0, 512},
+	{"np1501", 504 * 1024,    0,  0, 512},
+	{"np2150", 504 * 1024,    0,  0, 512},
+};
+
+static constexpr bool geometries_sorted(unsigned long i = 1)
 {
-	if (strcmp(tag, "np1100") == 0) {
-		page = 2048;
-		oob = 64;
-		return;
+	return i >= sizeof(geometries) / sizeof(geometries[0]) ||
+		(tag_key(geometries[i - 1].tag) < tag_key(geometries[i].tag) && geometries_sorted(i + 1));
+}
+static_assert(geometries_sorted(), "Device geometry table must be sorted by tag");
+
+// Devices added or replaced by --geometry=FILE, in pkg.cfg style:
+// [device] sections of tag=, leb=, page=, oob= and align= lines, in any
+// order. Values replace those of the built-in entry with the same tag.
+static std::vector<geometry_t> load_geometries(const std::string &file)
+{
+	std::vector<geometry_t> geos;
+	if (file.empty())
+		return geos;
+	std::ifstream sin(file);
+	if (!sin.is_open())
+		throw std::runtime_error("Could not open geometry file " + file);
+
+	// Values and line numbers by key, for each section
+	std::vector<std::map<std::string, std::pair<std::string, uint32_t>>> sections;
+	std::string line;
+	uint32_t lnum = 0;
+	while (std::getline(sin, line)) {
+		lnum++;
+		if (line.empty() || line[0] == '#')
+			continue;
+		if (line.compare("[device]") == 0) {
+			sections.emplace_back();
+			continue;
+		}
+		unsigned long eq = line.find('=');
+		std::string key = line.substr(0, eq);
+		if (sections.empty() || eq == std::string::npos ||
+				(key != "tag" && key != "leb" && key != "page" && key != "oob" && key != "align"))
+			throw std::runtime_error("Unrecognised geometry configuration at " +
+				file + ":" + std::to_string(lnum) + ": " + line);
+		sections.back()[key] = std::make_pair(line.substr(eq + 1), lnum);
 	}
-	throw std::runtime_error("Unknown NAND size for " + std::string(tag));
+
+	for (auto &keys: sections) {
+		geometry_t g = {"", 0, 0, 0, 512};
+		auto it = keys.find("tag");
+		if (it != keys.end()) {
+			strncpy(g.tag, it->second.first.c_str(), sizeof(g.tag) - 1);
+			// Start from the built-in entry when replacing one
+			for (auto &b: geometries)
+				if (tag_key(b.tag) == tag_key(g.tag))
+					g = b;
+		}
+		auto number = [&](const std::string &key, unsigned long &v) {
+			auto it = keys.find(key);
+			if (it == keys.end())
+				return;
+			if (!parse_number(it->second.first, v))
+				throw std::runtime_error("Invalid number at " + file + ":" +
+					std::to_string(it->second.second) + ": " + key + "=" + it->second.first);
+			if (key == "align" && v == 0)
+				throw std::runtime_error("Zero alignment at " + file + ":" + std::to_string(it->second.second));
+		};
+		number("leb", g.leb);
+		number("page", g.page);
+		number("oob", g.oob);
+		number("align", g.align);
+		geos.push_back(g);
+	}
+	return geos;
+}
+
+// Geometry of the device with tag, sizes left 0 for unknown devices so
+// that only segments which need them fail
+static geometry_t tag_geometry(const char *tag)
+{
+	static const std::vector<geometry_t> overrides = load_geometries(geometry_file);
+	uint64_t key = tag_key(tag);
+	for (auto it = overrides.rbegin(); it != overrides.rend(); it++)
+		if (tag_key(it->tag) == key)
+			return *it;
+	auto it = std::lower_bound(std::begin(geometries), std::end(geometries), key,
+			[](const geometry_t &g, uint64_t key) {return tag_key(g.tag) < key;});
+	if (it != std::end(geometries) && tag_key(it->tag) == key)
+		return *it;
+	geometry_t g = {"", 0, 0, 0, 512};
+	strncpy(g.tag, tag, 8);
+	return g;
 }
 
 static uint32_t fstype(const std::string &str)
@@ -113,124 +190,65 @@ static std::string fstype(uint32_t v)
 	return "unknown" + std::to_string(v);
 }
 
-static void codec(void *p, unsigned long size)
-{
-	if (size % 8)
-		throw std::runtime_error("Unexpected codec block size " + std::to_string(size));
-	uint64_t *pv = static_cast<uint64_t *>(p);
-	while (size) {
-		uint64_t v = *pv;
-		// Swap every 2 bits
-		*pv++ = ((v & 0xaaaaaaaaaaaaaaaa) >> 1) | ((v & 0x5555555555555555) << 1);
-		size -= 8;
-	}
-}
-
-uint32_t np_crc32(uint32_t crc, const void *buf, size_t size)
-{
-	return 0xffffffff ^ crc32(crc ^ 0xffffffff, buf, size);
-}
-
-uint32_t np_crc32(std::ifstream &in, unsigned long size)
+// Checksum segment s from its mapped data
+static uint32_t segment_crc32(const uint8_t *data, const header_t::pkg_t &s, const geometry_t &geo)
 {
-	static const unsigned long block = 4 * 1024 * 1024;	// Block size 4MiB
-	uint8_t buf[block];
-	uint32_t crc = 0;
-	while (size) {
-		unsigned long s = std::min(block, size);
-		in.read(reinterpret_cast<char *>(buf), s);
-		crc = np_crc32(crc, buf, s);
-		size -= s;
-	}
-	return crc;
+	segment_crc_t crc(s.fstype, geo);
+	map_advise(data, s.size, MADV_WILLNEED);
+	crc.update(data, s.size);
+	return crc.final();
 }
 
-int is_unmap_block(uint8_t *buf, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++)
-		if (buf[i] != 0xff)
-			return 0;
-	return 1;
-}
-
-uint32_t np_crc32_ubifs(std::ifstream &in, unsigned long size, unsigned long leb_size)
-{
-	const unsigned long block = leb_size + 4;
-	uint8_t buf[block];
-	uint32_t crc = 0;
-	while (size >= 4) {
-		unsigned long s = std::min(block, size);
-		in.read(reinterpret_cast<char *>(buf), s);
-		// ubirefimg: First u32 means number of skipped unmapped LEBs
-		// is_unmap_block should never return 1 for ubirefimg images
-		if (is_unmap_block(buf + 4, s - 4) == 0)
-			crc = np_crc32(crc, buf + 4, s - 4);
-		size -= s;
-	}
-	return crc;
-}
 
-uint32_t np_crc32_nand(std::ifstream &in, unsigned long size, unsigned long page, unsigned long oob)
-{
-	const unsigned long block = page + oob;
-	uint8_t buf[block];
-	uint32_t crc = 0;
-	while (size >= 4) {
-		unsigned long s = std::min(block, size);
-		in.read(reinterpret_cast<char *>(buf), s);
-		crc = np_crc32(crc, buf, s < page ? s : page);
-		size -= s;
-	}
-	return crc;
-}
+// Segment checksums of the last create, in out + ".crc". A segment whose
+// input file, geometry and offset are unchanged is still in place in out
+// if out itself has not changed since it was written.
+struct seg_cache_t {
+	unsigned long offset, size;
+	uint32_t fstype;
+	unsigned long leb, page, oob;
+	unsigned long dev, ino, mtime, ctime;
+	uint32_t crc;
+	std::string file;
+};
 
-static void verify_crc32(std::string path, const header_t::pkg_t &s, const char *tag)
+// Cached segments, empty if the cache is missing or does not match out
+static std::vector<seg_cache_t> load_seg_cache(const std::string &out)
 {
-	std::ifstream sbin(path);
-	uint32_t crc = 0;
-	if (s.fstype == FsUbifs) {
-		unsigned long leb_size = tag_ubifs_leb_size(tag);
-		crc = np_crc32_ubifs(sbin, s.size, leb_size);
-	} else if (s.fstype == FsRawNand) {
-		unsigned long page, oob;
-		tag_nand_size(tag, page, oob);
-		crc = np_crc32_nand(sbin, s.size, page, oob);
-	} else {
-		crc = np_crc32(sbin, s.size);
+	std::vector<seg_cache_t> segs;
+	std::ifstream sin(out + ".crc");
+	std::string stamp = file_stamp(out), line;
+	if (!sin.is_open() || stamp.empty() || !std::getline(sin, line) || line != "out " + stamp)
+		return segs;
+	while (std::getline(sin, line)) {
+		seg_cache_t c;
+		std::istringstream ss(line);
+		if (!(ss >> c.offset >> c.size >> c.fstype >> c.leb >> c.page >> c.oob >>
+				c.dev >> c.ino >> c.mtime >> c.ctime >> std::hex >> c.crc) || !(ss >> std::ws) ||
+				!std::getline(ss, c.file))
+			return std::vector<seg_cache_t>();
+		segs.push_back(c);
 	}
-	if (crc != s.crc)
-		throw std::runtime_error("Checksum mismatch!");
+	return segs;
 }
 
-static void append(const char *tag, header_t::pkg_t &s,
-		std::ofstream &sout, const std::string &out,
-		const boost::filesystem::path &parent, const std::string &file)
+static void save_seg_cache(const std::string &out, const std::vector<seg_cache_t> &segs)
 {
-	std::string filename((parent / file).native());
-	std::ifstream sbin(filename);
-	if (!sbin.is_open())
-		throw std::runtime_error("Could not open input file " + filename);
-
-	// Get file size
-	sbin.seekg(0, std::ios::end);
-	s.size = sbin.tellg();
-	sbin.seekg(0);
-
-	std::clog << "if=" << filename << " of=" << out << " seek=" << sout.tellp() << " size=" << s.size;
-	copy(sout, sbin, s.size, 512);	// Align to 512-byte boundary for mount
-
-	sbin.seekg(0);
-	if (s.fstype == FsUbifs) {
-		unsigned long leb_size = tag_ubifs_leb_size(tag);
-		s.crc = np_crc32_ubifs(sbin, s.size, leb_size);
-	} else if (s.fstype == FsRawNand) {
-		unsigned long page, oob;
-		tag_nand_size(tag, page, oob);
-		s.crc = np_crc32_nand(sbin, s.size, page, oob);
-	} else {
-		s.crc = np_crc32(sbin, s.size);
-	}
-	std::clog << " crc=0x" << std::hex << std::setfill('0') << std::setw(8) << s.crc << std::endl;
+	std::string stamp = file_stamp(out);
+	if (stamp.empty())
+		throw std::runtime_error("Could not stat output file " + out);
+	std::string tmp = out + ".crc.tmp";
+	std::ofstream sout(tmp);
+	if (!sout.is_open())
+		throw std::runtime_error("Could not open output file " + tmp);
+	sout << "out " << stamp << std::endl;
+	for (auto &c: segs)
+		sout << c.offset << " " << c.size << " " << c.fstype << " " << c.leb << " " << c.page << " "
+		     << c.oob << " " << c.dev << " " << c.ino << " " << c.mtime << " " << c.ctime << " "
+		     << std::hex << c.crc << std::dec << " " << c.file << std::endl;
+	sout.close();
+	if (!sout || rename(tmp.c_str(), (out + ".crc").c_str()) != 0)
+		throw std::runtime_error("Could not write output file " + out + ".crc");
 }
 
 void create_1000(const std::string &in, const std::string &out)
@@ -239,32 +257,29 @@ void create_1000(const std::string &in, const std::string &out)
 	if (!sin.is_open())
 		throw std::runtime_error("Could not open input file " + in);
 
-	std::ofstream sout(out);
-	if (!sout.is_open())
-		throw std::runtime_error("Could not open output file " + out);
-
 	// Create header of size 2k bytes
 	uint8_t header[2048] = {0};
 	header_t &h(*reinterpret_cast<header_t *>(header));
-	sout.write(reinterpret_cast<char *>(header), sizeof(header));
 
+	// Plan segment layout from configuration and file sizes
 	boost::filesystem::path parent(boost::filesystem::path(in).parent_path());
-	struct {
+	struct pkg_cfg_t {
 		uint32_t idx, include = 0;
 		uint32_t ver, fstype, crc;
 		std::string file, dev;
 		bool crcovw = false;		// CRC overwrite
+		unsigned long offset, size;
+		struct stat st;
 	} pkg;
+	std::vector<pkg_cfg_t> segments;
+	unsigned long offset = sizeof(header);
 	auto fappend = [&] {
 		if (pkg.include) {
-			auto &s = h.pkg[pkg.idx - 1];
-			s.offset = sout.tellp();
-			s.ver = pkg.ver;
-			s.fstype = pkg.fstype;
-			strncpy(s.dev, pkg.dev.c_str(), sizeof(s.dev));
-			append(h.tag, s, sout, out, parent, pkg.file);
-			if (pkg.crcovw)
-				s.crc = pkg.crc;
+			pkg.file = (parent / pkg.file).native();
+			if (stat(pkg.file.c_str(), &pkg.st) != 0)
+				throw std::runtime_error("Could not open input file " + pkg.file);
+			pkg.size = pkg.st.st_size;
+			segments.push_back(pkg);
 			// Reset
 			pkg.include = 0;
 			pkg.crcovw = false;
@@ -315,27 +330,185 @@ void create_1000(const std::string &in, const std::string &out)
 		}
 	}
 	fappend();
+	sin.close();
 
-	// Encrypt and update header
+	// Align segments for mount
+	const geometry_t geo = tag_geometry(h.tag);
+	std::vector<seg_cache_t> cache(segments.size());
+	for (unsigned long i = 0; i < segments.size(); i++) {
+		pkg_cfg_t &seg = segments[i];
+		seg.offset = offset;
+		offset += (seg.size + geo.align - 1) / geo.align * geo.align;
+		const struct stat &st = seg.st;
+		cache[i] = seg_cache_t{seg.offset, seg.size, seg.fstype, geo.leb, geo.page, geo.oob,
+			(unsigned long)st.st_dev, (unsigned long)st.st_ino,
+			stat_ns(st.st_mtim), stat_ns(st.st_ctim), 0, seg.file};
+	}
+
+	// Segments unchanged since the last create are left in place
+	std::vector<bool> cached(segments.size(), false);
+	bool reuse = false;
+	if (seg_cache) {
+		for (auto &c: load_seg_cache(out)) {
+			for (unsigned long i = 0; i < segments.size(); i++) {
+				seg_cache_t &n = cache[i];
+				if (!cached[i] && c.offset == n.offset && c.size == n.size && c.fstype == n.fstype &&
+						c.leb == n.leb && c.page == n.page && c.oob == n.oob &&
+						c.dev == n.dev && c.ino == n.ino && c.mtime == n.mtime &&
+						c.ctime == n.ctime && c.file == n.file) {
+					n.crc = c.crc;
+					cached[i] = reuse = true;
+				}
+			}
+		}
+	}
+
+	int fd = open(out.c_str(), O_WRONLY | O_CREAT | (reuse ? 0 : O_TRUNC), 0666);
+	if (fd < 0)
+		throw std::runtime_error("Could not open output file " + out);
+
+	try {
+		// Copy and checksum segments at their planned offsets
+		parallel_for(segments.size(), jobs, [&](unsigned long i) {
+			const pkg_cfg_t &seg = segments[i];
+			if (cached[i])
+				return;
+			int fbin = open(seg.file.c_str(), O_RDONLY);
+			if (fbin < 0)
+				throw std::runtime_error("Could not open input file " + seg.file);
+			segment_crc_t crc(seg.fstype, geo);
+			try {
+				copy(fd, seg.offset, fbin, 0, seg.size, geo.align, [&](const void *buf, unsigned long size) {
+					crc.update(buf, size);
+				});
+			} catch (...) {
+				close(fbin);
+				throw;
+			}
+			close(fbin);
+			cache[i].crc = crc.final();
+		});
+		if (reuse && ftruncate(fd, offset) != 0)
+			throw std::runtime_error("Could not truncate output file " + out);
+
+		// Update header in configuration order
+		for (unsigned long i = 0; i < segments.size(); i++) {
+			const pkg_cfg_t &seg = segments[i];
+			auto &s = h.pkg[seg.idx - 1];
+			s.offset = seg.offset;
+			s.ver = seg.ver;
+			s.fstype = seg.fstype;
+			strncpy(s.dev, seg.dev.c_str(), sizeof(s.dev));
+			s.size = seg.size;
+			s.crc = cache[i].crc;
+			std::clog << "if=" << seg.file << " of=" << out << " seek=" << s.offset << " size=" << s.size;
+			std::clog << " crc=0x" << std::hex << std::setfill('0') << std::setw(8) << s.crc;
+			std::clog << (cached[i] ? " cached" : "") << std::endl;
+			if (seg.crcovw)
+				s.crc = seg.crc;
+		}
+
+		// Encrypt and write header
+		codec(static_cast<void *>(header), sizeof(header));
+		pwrite_full(fd, header, sizeof(header), 0);
+	} catch (...) {
+		close(fd);
+		unlink((out + ".crc").c_str());
+		throw;
+	}
+	if (close(fd) != 0)
+		throw std::runtime_error("Could not write output file " + out);
+	if (seg_cache)
+		save_seg_cache(out, cache);
+}
+
+// Copy and decode header of size 2k bytes from mapped image
+static void read_header(const uint8_t *data, unsigned long size, const std::string &in,
+		uint8_t (&header)[2048])
+{
+	if (size < sizeof(header))
+		throw std::runtime_error("Unexpected EOF from " + in);
+	memcpy(header, data, sizeof(header));
 	codec(static_cast<void *>(header), sizeof(header));
-	sout.seekp(0);
-	sout.write(reinterpret_cast<char *>(header), sizeof(header));
+}
 
-	sin.close();
-	sout.close();
+// Check that segment s lies within the image
+static void check_segment(const header_t::pkg_t &s, unsigned long size, const std::string &in)
+{
+	if ((unsigned long)s.offset + s.size > size)
+		throw std::runtime_error("Unexpected EOF at " + in + " offset " + std::to_string(s.offset));
+}
+
+// Extract segments from forward-only input in offset order, skipping gaps by reading
+static void stream_segments(int fd, const std::string &in, unsigned long pos, const geometry_t &geo,
+		std::vector<std::pair<const header_t::pkg_t *, std::string>> segments)
+{
+	std::stable_sort(segments.begin(), segments.end(), [](
+			const std::pair<const header_t::pkg_t *, std::string> &a,
+			const std::pair<const header_t::pkg_t *, std::string> &b) {
+		return a.first->offset < b.first->offset;
+	});
+	auto pbuf = buffer_get();
+	uint8_t *buf = pbuf.get();
+	for (auto &seg: segments) {
+		const header_t::pkg_t &s = *seg.first;
+		const std::string &filename = seg.second;
+		if (s.offset < pos)
+			throw std::runtime_error("Could not stream overlapping segment at " + in +
+				" offset " + std::to_string(s.offset));
+		for (unsigned long gap = s.offset - pos; gap;) {
+			unsigned long n = std::min(gap, block_size);
+			if (read_full(fd, buf, n) != n)
+				throw std::runtime_error("Unexpected EOF at " + in + " offset " + std::to_string(s.offset));
+			gap -= n;
+		}
+		pos = s.offset;
+
+		int fbin = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fbin < 0)
+			throw std::runtime_error("Could not open output file " + filename);
+		segment_crc_t crc(s.fstype, geo);
+		try {
+			for (unsigned long done = 0; done < s.size;) {
+				unsigned long n = std::min((unsigned long)s.size - done, block_size);
+				if (read_full(fd, buf, n) != n)
+					throw std::runtime_error("Unexpected EOF at " + in + " offset " + std::to_string(s.offset));
+				crc.update(buf, n);
+				pwrite_full(fbin, buf, n, done);
+				done += n;
+			}
+		} catch (...) {
+			close(fbin);
+			throw;
+		}
+		pos += s.size;
+		if (close(fbin) != 0)
+			throw std::runtime_error("Could not write output file " + filename);
+		if (crc.final() != s.crc)
+			throw std::runtime_error("Checksum mismatch in " + filename);
+	}
 }
 
 void extract_1000(const std::string &in, const std::string &out, bool ext)
 {
-	std::ifstream sin(in, std::ios::binary);
-	if (!sin.is_open())
-		throw std::runtime_error("Could not open input file " + in);
+	unsigned long insize;
+	std::shared_ptr<const uint8_t> map;
 
-	// Read header of size 2k bytes
+	// Read header of size 2k bytes, streams are read forward from there
 	uint8_t header[2048];
-	if (!sin.read(reinterpret_cast<char *>(header), sizeof(header)))
-		throw std::runtime_error("Unexpected EOF from " + in);
-	codec(static_cast<void *>(header), sizeof(header));
+	int fd = -1;
+	if (input_stream(in)) {
+		insize = ULONG_MAX;
+		fd = open_stream(in);
+		if (read_full(fd, header, sizeof(header)) != sizeof(header)) {
+			close(fd);
+			throw std::runtime_error("Unexpected EOF from " + in);
+		}
+		codec(static_cast<void *>(header), sizeof(header));
+	} else {
+		map = map_file(in, insize);
+		read_header(map.get(), insize, in, header);
+	}
 
 	// Write segment configuration
 	std::ofstream sout(out);
@@ -343,10 +516,12 @@ void extract_1000(const std::string &in, const std::string &out, bool ext)
 		throw std::runtime_error("Could not open output file " + out);
 
 	header_t &h(*reinterpret_cast<header_t *>(header));
+	const geometry_t geo = tag_geometry(h.tag);
 	sout << "[header]" << std::endl;
 	sout << "tag=" << std::string(h.tag, sizeof(h.tag)).c_str() << std::endl;
 	sout << "ver=0x" << std::hex << std::setfill('0') << std::setw(8) << h.ver << std::endl;
 
+	std::vector<std::pair<const header_t::pkg_t *, std::string>> segments;
 	auto *s = h.pkg;
 	for (unsigned long i = 1; i < sizeof(header)/sizeof(s->_blk); i++, s++) {
 		if (!s->size)
@@ -365,20 +540,89 @@ void extract_1000(const std::string &in, const std::string &out, bool ext)
 		sout << "fstype=" << fstype(s->fstype) << std::endl;
 		sout << "# crc=0x" << std::hex << std::setfill('0') << std::setw(8) << s->crc << std::endl;
 
-		// Extract segment to file
-		if (!ext)
-			continue;
+		check_segment(*s, insize, in);
 		boost::filesystem::path p(out);
-		filename = (p.parent_path() / filename).native();
-		std::ofstream sbin(filename, std::ios::binary);
-		if (!sbin.is_open())
-			throw std::runtime_error("Could not open output file " + filename);
-		std::clog << "if=" << in << " of=" << filename << " skip=" << s->offset << " size=" << s->size
-			  << " crc=0x" << std::hex << std::setfill('0') << std::setw(8) << s->crc << std::endl;
-		if (!sin.seekg(s->offset))
-			throw std::runtime_error("Unexpected EOF at " + in + " offset " + std::to_string(s->offset));
-		copy(sbin, sin, s->size, 1);
-		sbin.close();
-		verify_crc32(filename, *s, h.tag);
+		segments.emplace_back(s, (p.parent_path() / filename).native());
+	}
+	sout.close();
+	if (!ext) {
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	// Extract segments to files, each job reads from the shared fd
+	bool stream = fd >= 0;
+	if (!stream)
+		fd = open(in.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Could not open input file " + in);
+	for (auto &seg: segments)
+		std::clog << "if=" << in << " of=" << seg.second << " skip=" << seg.first->offset
+			  << " size=" << seg.first->size << " crc=0x" << std::hex << std::setfill('0')
+			  << std::setw(8) << seg.first->crc << std::endl;
+	try {
+		if (stream) {
+			stream_segments(fd, in, sizeof(header), geo, segments);
+		} else {
+			parallel_for(segments.size(), jobs, [&](unsigned long i) {
+				const header_t::pkg_t &s = *segments[i].first;
+				const std::string &filename = segments[i].second;
+				int fbin = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+				if (fbin < 0)
+					throw std::runtime_error("Could not open output file " + filename);
+				// Verify checksum as the segment passes through
+				segment_crc_t crc(s.fstype, geo);
+				try {
+					copy(fbin, 0, fd, s.offset, s.size, 1, [&](const void *buf, unsigned long size) {
+						crc.update(buf, size);
+					});
+				} catch (...) {
+					close(fbin);
+					throw;
+				}
+				if (close(fbin) != 0)
+					throw std::runtime_error("Could not write output file " + filename);
+				if (crc.final() != s.crc)
+					throw std::runtime_error("Checksum mismatch in " + filename);
+			});
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+}
+
+void verify_1000(const std::string &in)
+{
+	unsigned long insize;
+	auto map = map_file(in, insize);
+
+	// Read header of size 2k bytes
+	uint8_t header[2048];
+	read_header(map.get(), insize, in, header);
+
+	// Checksum segments in place
+	header_t &h(*reinterpret_cast<header_t *>(header));
+	const geometry_t geo = tag_geometry(h.tag);
+	unsigned long failed = 0;
+	auto *s = h.pkg;
+	for (unsigned long i = 1; i < sizeof(header)/sizeof(s->_blk); i++, s++) {
+		if (!s->size)
+			continue;
+		check_segment(*s, insize, in);
+		uint32_t crc = segment_crc32(map.get() + s->offset, *s, geo);
+		std::clog << "segment" << std::dec << std::setfill('0') << std::setw(2) << i
+			  << " skip=" << s->offset << " size=" << s->size
+			  << " crc=0x" << std::hex << std::setw(8) << s->crc;
+		if (crc != s->crc) {
+			std::clog << " mismatch 0x" << std::setw(8) << crc << std::endl;
+			failed++;
+		} else {
+			std::clog << " ok" << std::endl;
+		}
 	}
+	if (failed)
+		throw std::runtime_error("Checksum mismatch in " + std::to_string(failed) + " segment(s)");
 }
@@ -6,11 +6,23 @@
 #include <sstream>
 #include <stdexcept>
 #include <cstdint>
+#include <climits>
 #include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <boost/filesystem.hpp>
 #include <zlib.h>
-
-void codec_xor(void *p, unsigned long size, const void *pattern, const unsigned long psize);
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "codec.h"
+#include "crc32.h"
+#include "inflate.h"
+#include "io.h"
 
 #pragma pack(push, 1)
 union setup_t {
@@ -87,6 +99,92 @@ static const uint8_t pattern[] = {
 	0x3a, 0x22, 0x0a, 0x33, 0x3e, 0x26, 0x0e, 0x35,  0x1d, 0x05, 0x2c, 0x14, 0x1b, 0x03, 0x0a, 0x04,
 };
 
+// Sequential reader over mapped update.bin
+struct reader_t {
+	const uint8_t *data;
+	unsigned long size, pos;
+
+	// Forward-only stream when fd >= 0 with unknown size. buf holds the
+	// data from offset base returned by the last next(), seeking back is
+	// possible within it, gaps are skipped by reading.
+	int fd = -1;
+	std::vector<uint8_t> buf;
+	unsigned long base = 0;
+
+	bool seek(unsigned long offset)
+	{
+		if (fd >= 0 ? offset < base : offset > size)
+			return false;
+		pos = offset;
+		return true;
+	}
+
+	// Pointer to the next n bytes, nullptr past end of file
+	const uint8_t *next(unsigned long n)
+	{
+		if (fd >= 0)
+			return fill(n);
+		if (n > size - pos)
+			return nullptr;
+		pos += n;
+		return data + pos - n;
+	}
+
+	// Step over n bytes, lazily when streaming
+	bool skip(unsigned long n)
+	{
+		if (fd < 0)
+			return next(n);
+		pos += n;
+		return true;
+	}
+
+	// Stream the next n bytes into buf, growing it as data arrives
+	const uint8_t *fill(unsigned long n)
+	{
+		unsigned long end = base + buf.size();
+		if (pos + n <= end) {
+			pos += n;
+			return buf.data() + (pos - n - base);
+		}
+		unsigned long have = 0;
+		if (pos < end) {
+			have = end - pos;
+			buf.erase(buf.begin(), buf.begin() + (pos - base));
+		} else {
+			buf.clear();
+			for (unsigned long gap = pos - end; gap;) {
+				unsigned long s = std::min(gap, block_size);
+				buf.resize(s);
+				if (read_full(fd, buf.data(), s) != s)
+					return nullptr;
+				gap -= s;
+			}
+			buf.clear();
+		}
+		base = pos;
+		while (have < n) {
+			unsigned long s = std::min(n - have, block_size);
+			buf.resize(have + s);
+			if (read_full(fd, buf.data() + have, s) != s) {
+				buf.resize(have);
+				return nullptr;
+			}
+			have += s;
+		}
+		pos += n;
+		return buf.data();
+	}
+
+	bool read(void *p, unsigned long n)
+	{
+		const uint8_t *pn = next(n);
+		if (pn)
+			memcpy(p, pn, n);
+		return pn;
+	}
+};
+
 static std::string destination(uint32_t v)
 {
 	static const char *pdest[] = {
@@ -105,130 +203,276 @@ static std::string destination(uint32_t v)
 	return pdest[v];
 }
 
-static void zlib_inflate(void *zbuf, uint32_t zsize, void *ubuf, uint32_t usize)
+// Destination index from its name, as printed by destination()
+static uint32_t destination(const std::string &s)
 {
-	z_stream strm;
-	strm.next_in   = reinterpret_cast<z_const Bytef *>(zbuf);
-	strm.avail_in  = zsize;
-	strm.total_in  = 0;
-	strm.next_out  = reinterpret_cast<Bytef *>(ubuf);
-	strm.avail_out = usize;
-	strm.total_out = 0;
-	strm.zalloc    = Z_NULL;
-	strm.zfree     = Z_NULL;
-	strm.opaque    = Z_NULL;
-
-	// +32: Detect gzip or zlib
-	int err = inflateInit2(&strm, 32 + MAX_WBITS);
-	if (err != Z_OK) {
-		inflateEnd(&strm);
-		throw std::runtime_error("zlib inflate init error: " + std::string(zError(err)));
-	}
-	// Single step inflate
-	err = inflate(&strm, Z_FINISH);
-	inflateEnd(&strm);
-	if (err != Z_STREAM_END)
-		throw std::runtime_error("zlib inflate error: " + std::string(zError(err)));
-	if (strm.total_in != zsize)
-		throw std::runtime_error("zlib compressed size mismatch: " + std::to_string(strm.total_in) +
-				" should be " + std::to_string(zsize));
-	if (strm.total_out != usize)
-		throw std::runtime_error("zlib uncompressed size mismatch: " + std::to_string(strm.total_out) +
-				" should be " + std::to_string(usize));
+	for (uint32_t v = 0; destination(v).compare(0, 7, "unknown") != 0; v++)
+		if (destination(v) == s)
+			return v;
+	if (s.compare(0, 7, "unknown") == 0)
+		return std::stoul(s.substr(7));
+	throw std::runtime_error("Unknown destination " + s);
 }
 
-static void copy(std::ifstream &sin, const std::string &out, const std::string &file,
-		long offset, unsigned long size, unsigned long align, int codec, bool ext, bool inflate = false)
+// Select XOR pattern, pattern 0 leaves data unchanged and returns nullptr
+static const void *select_pattern(int codec, uint64_t &xpattern, uint32_t &xsize)
 {
-	if (offset >= 0 && !sin.seekg(offset))
-		throw std::runtime_error("Could not seek to offset " + std::to_string(offset));
-
-	boost::filesystem::path p(out);
-	std::string filename = (p.parent_path() / file).native();
-	std::ofstream sout(filename, std::ios::binary);
-	if (ext && !sout.is_open())
-		throw std::runtime_error("Could not open output file " + filename);
-
-	// Select XOR pattern
-	uint64_t xpattern;
-	const uint64_t *px = 0;
-	uint32_t xsize = 0;
+	xsize = 0;
 	if (codec < 0) {
-		px = reinterpret_cast<const uint64_t *>(pattern);
 		xsize = sizeof(pattern);
-	} else {
+		return pattern;
+	} else if (codec != 0) {
 		memset(&xpattern, codec, sizeof(xpattern));
-		px = &xpattern;
 		xsize = sizeof(xpattern);
+		return &xpattern;
 	}
+	return nullptr;
+}
+
+// Device checksums: the algorithm is not documented and not yet confirmed on
+// an image with a nonzero cksum. CRC-32 of the decoded section data (the
+// dumped file) is assumed and 0 means no checksum. A mismatch is reported as
+// unconfirmed and never fails, creation keeps the logged value.
+static uint32_t data_crc32(uint32_t crc, const void *buf, unsigned long size)
+{
+	return crc32(crc, buf, size);
+}
 
-	void *ubuf = 0, *zbuf = 0;
-	while (inflate) {
+// Chunk of a compressed device section, every chunk is an independent stream
+struct chunk_t {
+	const uint8_t *pz;
+	uint32_t zsize, usize;
+	unsigned long offset;	// Uncompressed offset in the section
+};
+
+// Scan the chunk headers of a compressed section up to the end marker
+static std::vector<chunk_t> scan_chunks(reader_t &sin)
+{
+	std::vector<chunk_t> chunks;
+	unsigned long uoffset = 0;
+	for (;;) {
 		uint32_t usize, zsize;
-		if (!sin.read(reinterpret_cast<char *>(&usize), sizeof(usize)))
+		if (!sin.read(&usize, sizeof(usize)))
 			throw std::runtime_error("Could not read uncompressed size");
-		if (!sin.read(reinterpret_cast<char *>(&zsize), sizeof(zsize)))
+		if (!sin.read(&zsize, sizeof(zsize)))
 			throw std::runtime_error("Could not read compressed size");
-		if (usize == 0) {
-			free(ubuf);
-			free(zbuf);
-			return;		// No padding applied
-		}
-		ubuf = realloc(ubuf, usize);
-		if (ubuf == nullptr)
-			throw std::runtime_error("Could not allocate inflate buffer");
-		uint32_t asize = (zsize + 7) & ~7;	// Align to 8-byte boundary
-		zbuf = realloc(zbuf, asize);
-		if (asize && zbuf == nullptr)
-			throw std::runtime_error("Could not allocate deflate buffer");
-		if (!sin.read(reinterpret_cast<char *>(zbuf), zsize))
+		if (usize == 0)
+			return chunks;
+		const uint8_t *pz = sin.next(zsize);
+		if (!pz)
 			throw std::runtime_error("Could not read zlib data");
-		if (px)
-			codec_xor(zbuf, asize, px, xsize);
-		zlib_inflate(zbuf, zsize, ubuf, usize);
-		if (ext)
-			sout.write(reinterpret_cast<char *>(ubuf), usize);
+		chunks.push_back(chunk_t{pz, zsize, usize, uoffset});
+		uoffset += usize;
 	}
+}
 
-	unsigned long bsize = 4 * 1024 * 1024;	// Block size 4MiB
-	uint8_t buf[bsize];
-	unsigned long read = 0, rsize = size;
-	bsize = rsize ? std::min(rsize, bsize) : bsize;
-	while (sin.read(reinterpret_cast<char *>(buf), bsize), (read = sin.gcount()) != 0) {
-		if (px) {
-			unsigned long bsize = (read + 7) / 8 * 8;
-			codec_xor(buf, bsize, px, xsize);
+enum copy_mode_t {
+	CopyInfo,	// Walk headers only
+	CopyVerify,	// Decode and checksum without output
+	CopyExtract,	// Decode, checksum and write output
+};
+
+// Copy a section to file beside out, returns the checksum of decoded data
+static uint32_t copy(reader_t &sin, const std::string &out, const std::string &file,
+		long offset, unsigned long size, unsigned long align, int codec, copy_mode_t mode, bool inflate = false)
+{
+	if (offset >= 0 && !sin.seek(offset))
+		throw std::runtime_error("Could not seek to offset " + std::to_string(offset));
+	if (sin.fd >= 0 && !size && !inflate)
+		throw std::runtime_error("Could not stream section " + file + " extending to end of file");
+
+	// Info only: walk the chunk headers or step over the data
+	if (mode == CopyInfo) {
+		if (inflate) {
+			scan_chunks(sin);
+			return 0;
 		}
-		if (ext)
-			sout.write(reinterpret_cast<char *>(buf), read);
-		if (rsize) {
-			rsize -= read;
-			if (rsize == 0)
+		if (!sin.skip(size ? size : sin.size - sin.pos))
+			throw std::runtime_error("Unexpected end of file");
+		return 0;
+	}
+
+	bool ext = mode == CopyExtract;
+	boost::filesystem::path p(out);
+	std::string filename = (p.parent_path() / file).native();
+	// Only the paths that write in order open the file as a stream
+	std::ofstream sout;
+	auto open_sout = [&] {
+		if (!ext)
+			return;
+		sout.open(filename, std::ios::binary);
+		if (!sout.is_open())
+			throw std::runtime_error("Could not open output file " + filename);
+	};
+
+	uint64_t xpattern;
+	uint32_t xsize;
+	const void *px = select_pattern(codec, xpattern, xsize);
+
+	if (inflate && sin.fd >= 0) {
+		// Forward-only input: inflate every chunk as it arrives
+		open_sout();
+		zlib_inflater_t zinf;
+		uint32_t crc = 0;
+		for (;;) {
+			uint32_t usize, zsize;
+			if (!sin.read(&usize, sizeof(usize)))
+				throw std::runtime_error("Could not read uncompressed size");
+			if (!sin.read(&zsize, sizeof(zsize)))
+				throw std::runtime_error("Could not read compressed size");
+			if (usize == 0)
 				break;
-			bsize = std::min(rsize, bsize);
+			const uint8_t *pz = sin.next(zsize);
+			if (!pz)
+				throw std::runtime_error("Could not read zlib data");
+			zinf.inflate(pz, zsize, usize, px, xsize, [&](const void *buf, unsigned long size) {
+				crc = data_crc32(crc, buf, size);
+				if (ext)
+					sout.write(static_cast<const char *>(buf), size);
+			});
+		}
+		if (ext && !sout.flush())
+			throw std::runtime_error("Could not write output file " + filename);
+		return crc;
+	}
+
+	if (inflate) {
+		std::vector<chunk_t> chunks = scan_chunks(sin);
+
+		int fd = -1;
+		if (ext) {
+			fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (fd < 0)
+				throw std::runtime_error("Could not open output file " + filename);
+		}
+
+		// Inflate on worker threads, reusing idle inflaters
+		std::vector<uint32_t> crcs(chunks.size(), 0);
+		std::vector<std::unique_ptr<zlib_inflater_t>> idle;
+		std::mutex lock;
+		unsigned long n = threads ? threads : std::thread::hardware_concurrency();
+		try {
+			parallel_for(chunks.size(), n, [&](unsigned long i) {
+				const chunk_t &c = chunks[i];
+				std::unique_ptr<zlib_inflater_t> zinf;
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (!idle.empty()) {
+						zinf = std::move(idle.back());
+						idle.pop_back();
+					}
+				}
+				if (!zinf)
+					zinf.reset(new zlib_inflater_t);
+				map_advise(c.pz, c.zsize, MADV_WILLNEED);
+				unsigned long offset = c.offset;
+				zinf->inflate(c.pz, c.zsize, c.usize, px, xsize, [&](const void *buf, unsigned long size) {
+					crcs[i] = data_crc32(crcs[i], buf, size);
+					if (ext)
+						pwrite_full(fd, buf, size, offset);
+					offset += size;
+				});
+				std::lock_guard<std::mutex> guard(lock);
+				idle.push_back(std::move(zinf));
+			});
+		} catch (...) {
+			if (ext)
+				close(fd);
+			throw;
 		}
+		if (ext && close(fd) != 0)
+			throw std::runtime_error("Could not write output file " + filename);
+		uint32_t crc = 0;
+		for (unsigned long i = 0; i < chunks.size(); i++)
+			crc = crc32_combine(crc, crcs[i], chunks[i].usize);
+		return crc;		// No padding applied
+	}
+
+	// Size 0 extends to end of file, streams are read a block at a time
+	unsigned long rsize = size ? size : sin.size - sin.pos;
+	const uint8_t *pdata = nullptr;
+	if (sin.fd < 0) {
+		pdata = sin.next(rsize);
+		if (!pdata)
+			throw std::runtime_error("Unexpected end of file");
+		map_advise(pdata, rsize, MADV_WILLNEED);
+	}
+
+	open_sout();
+	auto pbuf = buffer_get();
+	uint8_t *buf = pbuf.get();
+	unsigned long phase = 0;
+	uint32_t crc = 0;
+	while (rsize) {
+		unsigned long s = std::min(rsize, block_size);
+		if (sin.fd >= 0 && !(pdata = sin.next(s)))
+			throw std::runtime_error("Unexpected end of file");
+		const uint8_t *ps = pdata;
+		if (px) {
+			phase = codec_xor(buf, pdata, s, px, xsize, phase);
+			ps = buf;
+		}
+		crc = data_crc32(crc, ps, s);
+		if (ext)
+			sout.write(reinterpret_cast<const char *>(ps), s);
+		pdata += s;
+		rsize -= s;
 	}
-	if (rsize)
-		throw std::runtime_error("Unexpected end of file");
-	sin.clear();
 
 	unsigned long padding = (align - (size % align)) % align;
 	if (ext && padding) {
 		bzero(buf, padding);
 		sout.write(reinterpret_cast<char *>(buf), padding);
 	}
+	return crc;
 }
 
-void extract_890(const std::string &in, const std::string &out, bool ext)
+// Seek index of a compressed device section
+struct dev_index_t {
+	uint32_t dev;
+	int pattern;
+	std::vector<chunk_t> chunks;
+};
+
+// Walk update.bin, collects the chunks of compressed devices into index
+// if given
+static void walk_890(reader_t &sin, const std::string &out, copy_mode_t mode,
+		std::vector<dev_index_t> *index = nullptr)
 {
-	std::ifstream sin(in, std::ios::binary);
-	if (!sin.is_open())
-		throw std::runtime_error("Could not open input file " + in);
+	// Write segment configuration, nowhere without out
+	std::ofstream flog;
+	std::ostream sout(nullptr);
+	if (!out.empty()) {
+		flog.open(out);
+		if (!flog.is_open())
+			throw std::runtime_error("Could not open output file " + out);
+		sout.rdbuf(flog.rdbuf());
+	}
 
-	// Write segment configuration
-	std::ofstream sout(out);
-	if (!sout.is_open())
-		throw std::runtime_error("Could not open output file " + out);
+	// The header walk stays serial and keeps dump.log in order, decoding
+	// is deferred to up to jobs workers, each with its own reader.
+	// Streams are decoded in place during a single forward pass.
+	std::vector<std::function<void()>> tasks;
+	auto section = [&](const std::string &file, long offset, unsigned long size, int codec,
+			bool inflate = false, uint32_t *crc = nullptr) {
+		if (sin.fd >= 0) {
+			uint32_t c = copy(sin, out, file, offset, size, 1, codec, mode, inflate);
+			if (crc)
+				*crc = c;
+			return;
+		}
+		reader_t r = sin;
+		copy(sin, out, file, offset, size, 1, codec, CopyInfo, inflate);
+		if (mode == CopyInfo)
+			return;
+		if (offset >= 0)
+			r.pos = offset;
+		tasks.push_back([=, &out]() mutable {
+			uint32_t c = copy(r, out, file, -1, size, 1, codec, mode, inflate);
+			if (crc)
+				*crc = c;
+		});
+	};
 
 	// Sections at constant offsets
 	static const struct {
@@ -242,17 +486,17 @@ void extract_890(const std::string &in, const std::string &out, bool ext)
 	};
 	sout << "Fixed offset encrypted sections" << std::endl;
 	for (auto &ps: sections) {
-		copy(sin, out, ps.file, ps.offset, ps.size, 1, ps.pattern, ext);
+		section(ps.file, ps.offset, ps.size, ps.pattern);
 		sout << ps.file << "\t" << "offset\t0x" << std::hex << ps.offset;
 		sout << "\tsize\t0x" << ps.size << "\t" << ps.name << std::endl;
 	}
 
 	// Setup information
 	long offset = 0x30000;
-	if (!sin.seekg(offset))
+	if (!sin.seek(offset))
 		throw std::runtime_error("Could not seek to offset " + std::to_string(offset));
 	setup_t setup;
-	if (!sin.read(reinterpret_cast<char *>(&setup), sizeof(setup)))
+	if (!sin.read(&setup, sizeof(setup)))
 		throw std::runtime_error("Could not read setup information");
 	if (setup.model[0] != 'n') {
 		// Early version
@@ -283,8 +527,7 @@ void extract_890(const std::string &in, const std::string &out, bool ext)
 		sout << "    Keep logs: " << setup.keeplogs << std::endl;
 		sout << "    Dump NAND: " << setup.dumpnand << std::endl;
 	} else {
-		// Version 1.1.02
-		setup.type = 2;
+		// Version 1.1.02, type overlaps reserved[1] so set it after printing
 		offset += sizeof(setup.v02.raw);
 		sout << std::endl << "Setup Information" << std::dec << std::endl;
 		sout << "    Version:     " << setup.v02.version << std::endl;
@@ -301,29 +544,30 @@ void extract_890(const std::string &in, const std::string &out, bool ext)
 		sout << "    Reserved[3]: " << setup.v02._reserved3 << std::endl;
 		sout << "    Reserved[4]: " << setup.v02._reserved4 << std::endl;
 		sout << "    Reserved[5]: " << setup.v02._reserved5 << std::endl;
+		setup.type = 2;
 	}
-	if (!sin.seekg(offset))
+	if (!sin.seek(offset))
 		throw std::runtime_error("Could not seek to offset " + std::to_string(offset));
 
 	// Device information
 	uint32_t ndev;
-	if (!sin.read(reinterpret_cast<char *>(&ndev), sizeof(ndev)))
+	if (!sin.read(&ndev, sizeof(ndev)))
 		throw std::runtime_error("Could not read number of devices");
-	device_t devs[ndev];
+	std::vector<device_t> devs(ndev);
 	for (uint32_t i = 0; i < ndev; i++) {
 		device_t &dev = devs[i];
-		if (!sin.read(reinterpret_cast<char *>(&dev), sizeof(dev.raw)))
+		if (!sin.read(&dev, sizeof(dev.raw)))
 			throw std::runtime_error("Could not read device information " + std::to_string(i));
 	}
 
 	// System data section
 	uint32_t nsys;
-	if (!sin.read(reinterpret_cast<char *>(&nsys), sizeof(nsys)))
+	if (!sin.read(&nsys, sizeof(nsys)))
 		throw std::runtime_error("Could not read number of system data sections");
 	sout << std::endl << "System file sections" << std::endl;
 	for (uint32_t i = 0; i < nsys; i++) {
 		system_t sys;
-		if (!sin.read(reinterpret_cast<char *>(&sys), sizeof(sys.raw)))
+		if (!sin.read(&sys, sizeof(sys.raw)))
 			throw std::runtime_error("Could not read system data section " + std::to_string(i));
 		std::string filename = "sys" + std::to_string(i) + (sys.compressed ? ".gz" : ".bin");
 		sout << "    sys" << i << std::endl;
@@ -332,16 +576,18 @@ void extract_890(const std::string &in, const std::string &out, bool ext)
 		sout << "        Uncompressed size: " << sys.rawsize << std::endl;
 		sout << "        Compressed:        " << sys.compressed << std::endl;
 		sout << "        Dumped file:       " << filename << std::endl;
-		copy(sin, out, filename, -1, sys.size, 1, 0, ext);
+		section(filename, -1, sys.size, 0);
 	}
 
 	// File offset table
 	uint32_t fpos[10];
-	if (!sin.read(reinterpret_cast<char *>(&fpos[0]), sizeof(fpos)))
+	if (!sin.read(&fpos[0], sizeof(fpos)))
 		throw std::runtime_error("Could not read file offset table");
 
 	// Dump device data section
 	sout << std::endl << "Device Information" << std::endl;
+	std::vector<std::string> files(ndev);
+	std::vector<uint32_t> crcs(ndev, 0);
 	for (uint32_t i = 0; i < ndev; i++) {
 		device_t &dev = devs[i];
 		std::string filename = destination(dev.dest);
@@ -359,6 +605,508 @@ void extract_890(const std::string &in, const std::string &out, bool ext)
 		filename += setup.type == 1 && dev.compressed ? ".gz" :
 				filename.find('.') == std::string::npos ? ".bin" : "";
 		sout << "        Dumped file:       " << filename << std::endl;
-		copy(sin, out, filename, offset, dev.size, 1, dev.pattern, ext, setup.type != 1 && dev.compressed);
+		bool chunked = setup.type != 1 && dev.compressed;
+		if (index && chunked) {
+			if (!sin.seek(offset))
+				throw std::runtime_error("Could not seek to offset " + std::to_string(offset));
+			index->push_back(dev_index_t{i, (int)dev.pattern, scan_chunks(sin)});
+			continue;
+		}
+		files[i] = filename;
+		if (sin.fd < 0)
+			section(filename, offset, dev.size, dev.pattern, chunked, &crcs[i]);
+	}
+
+	// Stream devices in offset order, info stops after the headers
+	if (sin.fd >= 0 && mode != CopyInfo) {
+		std::vector<uint32_t> order;
+		for (uint32_t i = 0; i < ndev; i++)
+			order.push_back(i);
+		std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+			return fpos[a] < fpos[b];
+		});
+		for (uint32_t i: order) {
+			const device_t &dev = devs[i];
+			section(files[i], fpos[i], dev.size, dev.pattern, setup.type != 1 && dev.compressed, &crcs[i]);
+		}
+	}
+
+	parallel_for(tasks.size(), jobs, [&](unsigned long i) {
+		tasks[i]();
+	});
+	if (mode == CopyInfo)
+		return;
+
+	for (uint32_t i = 0; i < ndev; i++) {
+		const device_t &dev = devs[i];
+		const std::string &filename = files[i];
+		uint32_t crc = crcs[i];
+		bool ok = !dev.cksum || crc == dev.cksum;
+		if (mode == CopyVerify) {
+			std::clog << "dev" << i << " file=" << filename << " size=" << std::dec << dev.size
+				  << " cksum=0x" << std::hex << std::setfill('0') << std::setw(8) << dev.cksum;
+			if (!dev.cksum)
+				std::clog << " unchecked" << std::endl;
+			else if (ok)
+				std::clog << " ok" << std::endl;
+			else
+				std::clog << " unconfirmed crc32=0x" << std::setw(8) << crc << std::endl;
+		} else if (!ok) {
+			std::clog << "Warning: unconfirmed checksum mismatch in " << filename << " cksum=0x" << std::hex
+				  << std::setfill('0') << std::setw(8) << dev.cksum << " crc32=0x" << std::setw(8)
+				  << crc << std::dec << std::endl;
+		}
+	}
+}
+
+static void walk_890(const std::string &in, const std::string &out, copy_mode_t mode)
+{
+	if (input_stream(in)) {
+		reader_t sin = {nullptr, ULONG_MAX, 0};
+		sin.fd = open_stream(in);
+		try {
+			walk_890(sin, out, mode);
+			close(sin.fd);
+			return;
+		} catch (...) {
+			close(sin.fd);
+			throw;
+		}
+	}
+
+	reader_t sin = {nullptr, 0, 0};
+	auto map = map_file(in, sin.size);
+	sin.data = map.get();
+	// Info only touches headers, no readahead of section data
+	map_advise(sin.data, sin.size, mode != CopyInfo ? MADV_SEQUENTIAL : MADV_RANDOM);
+	walk_890(sin, out, mode);
+}
+
+void extract_890(const std::string &in, const std::string &out, bool ext)
+{
+	walk_890(in, out, ext ? CopyExtract : CopyInfo);
+}
+
+void verify_890(const std::string &in)
+{
+	walk_890(in, "", CopyVerify);
+}
+
+// Seek index sidecar in.idx: image size and mtime, then for every compressed
+// device a dev line followed by one line per chunk with its compressed offset
+// in the image, compressed size, uncompressed offset and uncompressed size
+static void save_index(const std::string &in, const reader_t &sin, const std::vector<dev_index_t> &index)
+{
+	std::string stamp = file_stamp(in);
+	if (stamp.empty())
+		throw std::runtime_error("Could not stat " + in);
+	std::string file = in + ".idx", tmp = file + ".tmp";
+	std::ofstream sout(tmp);
+	if (!sout.is_open())
+		throw std::runtime_error("Could not open output file " + tmp);
+	sout << "image " << stamp << std::endl;
+	for (auto &di: index) {
+		sout << "dev " << di.dev << " " << di.pattern << " " << di.chunks.size() << std::endl;
+		for (auto &c: di.chunks)
+			sout << c.pz - sin.data << " " << c.zsize << " " << c.offset << " " << c.usize << std::endl;
+	}
+	sout.close();
+	if (!sout || rename(tmp.c_str(), file.c_str()) != 0) {
+		unlink(tmp.c_str());
+		throw std::runtime_error("Could not write index " + file);
+	}
+}
+
+// Load in.idx, false if it is missing, damaged or does not match in
+static bool load_index(const std::string &in, const reader_t &sin, std::vector<dev_index_t> &index)
+{
+	std::ifstream sidx(in + ".idx");
+	std::string stamp = file_stamp(in), key;
+	if (!sidx.is_open() || stamp.empty() || !std::getline(sidx, key) || key != "image " + stamp)
+		return false;
+	index.clear();
+	dev_index_t di;
+	unsigned long n;
+	while (sidx >> key >> di.dev >> di.pattern >> n) {
+		if (key != "dev")
+			return false;
+		di.chunks.clear();
+		unsigned long uoffset = 0;
+		for (unsigned long i = 0; i < n; i++) {
+			unsigned long zoffset;
+			chunk_t c;
+			if (!(sidx >> zoffset >> c.zsize >> c.offset >> c.usize) ||
+					zoffset > sin.size || c.zsize > sin.size - zoffset || c.offset != uoffset)
+				return false;
+			c.pz = sin.data + zoffset;
+			uoffset += c.usize;
+			di.chunks.push_back(c);
+		}
+		index.push_back(di);
+	}
+	return sidx.eof();
+}
+
+void index_890(const std::string &in)
+{
+	reader_t sin = {nullptr, 0, 0};
+	auto map = map_file(in, sin.size);
+	sin.data = map.get();
+	map_advise(sin.data, sin.size, MADV_RANDOM);
+
+	std::vector<dev_index_t> index;
+	walk_890(sin, "", CopyInfo, &index);
+	save_index(in, sin, index);
+	for (auto &di: index) {
+		unsigned long usize = di.chunks.empty() ? 0 : di.chunks.back().offset + di.chunks.back().usize;
+		std::clog << "dev" << di.dev << " chunks=" << di.chunks.size() << " size=" << usize << std::endl;
+	}
+}
+
+// Decode size bytes at uncompressed offset of compressed device dev to out,
+// inflating only the chunks covering the range. Size 0 reads to the end.
+void read_890(const std::string &in, const std::string &out,
+		unsigned long dev, unsigned long offset, unsigned long size)
+{
+	reader_t sin = {nullptr, 0, 0};
+	auto map = map_file(in, sin.size);
+	sin.data = map.get();
+	map_advise(sin.data, sin.size, MADV_RANDOM);
+
+	// Without a usable sidecar, walking the headers builds the same index
+	std::vector<dev_index_t> index;
+	if (!load_index(in, sin, index)) {
+		index.clear();
+		walk_890(sin, "", CopyInfo, &index);
+	}
+	auto pdi = std::find_if(index.begin(), index.end(), [&](const dev_index_t &di) {return di.dev == dev;});
+	if (pdi == index.end())
+		throw std::runtime_error("Device " + std::to_string(dev) + " is not a compressed section");
+	const std::vector<chunk_t> &chunks = pdi->chunks;
+	unsigned long usize = chunks.empty() ? 0 : chunks.back().offset + chunks.back().usize;
+	if (offset > usize)
+		throw std::runtime_error("Offset " + std::to_string(offset) + " beyond section size " + std::to_string(usize));
+	if (size == 0 || size > usize - offset)
+		size = usize - offset;
+
+	std::ofstream sout(out, std::ios::binary);
+	if (!sout.is_open())
+		throw std::runtime_error("Could not open output file " + out);
+
+	uint64_t xpattern;
+	uint32_t xsize;
+	const void *px = select_pattern(pdi->pattern, xpattern, xsize);
+
+	if (!size)
+		return;
+
+	// Last chunk starting at or before offset
+	auto pc = std::upper_bound(chunks.begin(), chunks.end(), offset,
+			[](unsigned long o, const chunk_t &c) {return o < c.offset;}) - 1;
+	unsigned long end = offset + size;
+	zlib_inflater_t zinf;
+	for (; pc != chunks.end() && pc->offset < end; pc++) {
+		unsigned long coffset = pc->offset;
+		zinf.inflate(pc->pz, pc->zsize, pc->usize, px, xsize, [&](const void *buf, unsigned long s) {
+			unsigned long from = std::max(coffset, offset), to = std::min(coffset + s, end);
+			if (from < to)
+				sout.write(reinterpret_cast<const char *>(buf) + (from - coffset), to - from);
+			coffset += s;
+		});
+	}
+	if (!sout)
+		throw std::runtime_error("Could not write output file " + out);
+}
+
+// Uncompressed size of each chunk in compressed device sections
+static const uint32_t chunk_size = 1024 * 1024;
+
+// Write data to fd at offset in the chunked format read by copy(), deflating
+// batches of chunks on worker threads. Returns the section size.
+static unsigned long deflate_chunks(int fd, unsigned long offset, const uint8_t *data, unsigned long size,
+		const void *px, uint32_t xsize)
+{
+	unsigned long n = threads ? threads : std::thread::hardware_concurrency();
+	unsigned long nchunks = (size + chunk_size - 1) / chunk_size;
+	unsigned long start = offset;
+	std::vector<std::vector<uint8_t>> zchunks(std::max(1UL, n) * 4);
+	for (unsigned long c = 0; c < nchunks; c += zchunks.size()) {
+		unsigned long batch = std::min(nchunks - c, (unsigned long)zchunks.size());
+		parallel_for(batch, n, [&](unsigned long i) {
+			const uint8_t *p = data + (c + i) * chunk_size;
+			uint32_t usize = std::min((unsigned long)chunk_size, size - (c + i) * chunk_size);
+			std::vector<uint8_t> &z = zchunks[i];
+			uLongf zsize = compressBound(usize);
+			z.resize(8 + zsize);
+			int err = compress2(z.data() + 8, &zsize, p, usize, 9);
+			if (err != Z_OK)
+				throw std::runtime_error("zlib deflate error: " + std::string(zError(err)));
+			if (px)
+				codec_xor(z.data() + 8, z.data() + 8, zsize, px, xsize, 0);
+			uint32_t hdr[2] = {usize, static_cast<uint32_t>(zsize)};
+			memcpy(z.data(), hdr, sizeof(hdr));
+			z.resize(8 + zsize);
+		});
+		for (unsigned long i = 0; i < batch; i++) {
+			pwrite_full(fd, zchunks[i].data(), zchunks[i].size(), offset);
+			offset += zchunks[i].size();
+		}
+	}
+	// End of section marker
+	uint32_t hdr[2] = {0, 0};
+	pwrite_full(fd, hdr, sizeof(hdr), offset);
+	return offset + sizeof(hdr) - start;
+}
+
+// Write data to fd at offset, XOR encoded with px if set
+static void write_xor(int fd, unsigned long offset, const uint8_t *data, unsigned long size,
+		const void *px, uint32_t xsize)
+{
+	if (!px) {
+		pwrite_full(fd, data, size, offset);
+		return;
+	}
+	auto pbuf = buffer_get();
+	unsigned long phase = 0;
+	for (unsigned long pos = 0; pos < size;) {
+		unsigned long s = std::min(size - pos, block_size);
+		phase = codec_xor(pbuf.get(), data + pos, s, px, xsize, phase);
+		pwrite_full(fd, pbuf.get(), s, offset + pos);
+		pos += s;
+	}
+}
+
+void create_890(const std::string &in, const std::string &out)
+{
+	std::ifstream sin(in);
+	if (!sin.is_open())
+		throw std::runtime_error("Could not open input file " + in);
+
+	// Parse the dump.log written by extract_890()
+	typedef std::map<std::string, std::string> keys_t;
+	struct fixed_t {
+		std::string file;
+		unsigned long offset, size;
+	};
+	std::vector<fixed_t> fixed;
+	std::string section;
+	keys_t setupk;
+	std::vector<keys_t> syss, devs;
+	std::string line;
+	uint32_t lnum = 0;
+	while (std::getline(sin, line)) {
+		lnum++;
+		if (line.empty())
+			continue;
+		auto error = [&] {
+			return std::runtime_error("Unrecognised configuration at " +
+					in + ":" + std::to_string(lnum) + ": " + line);
+		};
+		if (line[0] != ' ') {
+			if (section == "Fixed offset encrypted sections" && line.find('\t') != std::string::npos) {
+				fixed_t f;
+				std::string koffset, ksize;
+				std::istringstream ss(line);
+				if (!(ss >> f.file >> koffset >> std::hex >> f.offset >> ksize >> f.size) ||
+						koffset != "offset" || ksize != "size")
+					throw error();
+				fixed.push_back(f);
+			} else {
+				section = line;
+			}
+			continue;
+		}
+
+		std::vector<keys_t> *items = section == "System file sections" ? &syss :
+				section == "Device Information" ? &devs : nullptr;
+		unsigned long b = line.find_first_not_of(' ');
+		unsigned long colon = line.find(':');
+		if (colon == std::string::npos) {
+			// New system or device entry
+			if (!items)
+				throw error();
+			items->emplace_back();
+			continue;
+		}
+		std::string key = line.substr(b, colon - b);
+		unsigned long v = line.find_first_not_of(' ', colon + 1);
+		std::string value = v == std::string::npos ? "" : line.substr(v);
+		if (section == "Setup Information" || section == "Menu Information")
+			setupk[key] = value;
+		else if (items && !items->empty())
+			items->back()[key] = value;
+		else
+			throw error();
+	}
+	sin.close();
+
+	auto get = [&](const keys_t &k, const std::string &key) {
+		auto it = k.find(key);
+		if (it == k.end())
+			throw std::runtime_error("Missing " + key + " in " + in);
+		return it->second;
+	};
+	auto getn = [&](const keys_t &k, const std::string &key) {
+		return static_cast<uint32_t>(std::stoul(get(k, key), nullptr, 0));
+	};
+	boost::filesystem::path parent(boost::filesystem::path(in).parent_path());
+	auto path = [&](const std::string &file) {
+		return (parent / file).native();
+	};
+
+	// Setup information, in one of three layouts
+	setup_t setup;
+	memset(&setup, 0, sizeof(setup));
+	unsigned long setup_size;
+	if (setupk.empty())
+		throw std::runtime_error("Missing setup information in " + in);
+	if (setupk.count("Version") == 0) {
+		// Early version
+		setup.type = 1;
+		setup_size = sizeof(setup.menu.raw);
+		strncpy(setup.menu.date, get(setupk, "Date").c_str(), sizeof(setup.menu.date));
+		setup.menu.autorun    = getn(setupk, "Auto run");
+		setup.menu.quiet      = getn(setupk, "Quiet");
+		setup.menu._reserved0 = getn(setupk, "Reserved[0]");
+		setup.menu._reserved1 = getn(setupk, "Reserved[1]");
+		setup.menu.keeplogs   = getn(setupk, "Keep logs");
+		setup.menu.dumpnand   = getn(setupk, "Dump NAND");
+		setup.menu._reserved2 = getn(setupk, "Reserved[2]");
+		setup.menu._reserved3 = getn(setupk, "Reserved[3]");
+		setup.menu._reserved4 = getn(setupk, "Reserved[4]");
+		setup.menu._reserved5 = getn(setupk, "Reserved[5]");
+	} else if (setupk.count("Quiet") == 0) {
+		// Newer version, the type word is the number of devices
+		setup_size = sizeof(setup.raw);
+		strncpy(setup.version,  get(setupk, "Version").c_str(),  sizeof(setup.version));
+		strncpy(setup.date,     get(setupk, "Date").c_str(),     sizeof(setup.date));
+		strncpy(setup.model,    get(setupk, "Model").c_str(),    sizeof(setup.model));
+		strncpy(setup.hostname, get(setupk, "Hostname").c_str(), sizeof(setup.hostname));
+		setup.autorun  = getn(setupk, "Auto run");
+		setup.keeplogs = getn(setupk, "Keep logs");
+		setup.dumpnand = getn(setupk, "Dump NAND");
+		if (devs.empty())
+			throw std::runtime_error("Newer setup layout needs at least one device");
+	} else {
+		// Version 1.1.02
+		setup_size = sizeof(setup.v02.raw);
+		strncpy(setup.v02.version,  get(setupk, "Version").c_str(),  sizeof(setup.v02.version));
+		strncpy(setup.v02.date,     get(setupk, "Date").c_str(),     sizeof(setup.v02.date));
+		strncpy(setup.v02.model,    get(setupk, "Model").c_str(),    sizeof(setup.v02.model));
+		strncpy(setup.v02.hostname, get(setupk, "Hostname").c_str(), sizeof(setup.v02.hostname));
+		setup.v02.autorun    = getn(setupk, "Auto run");
+		setup.v02.quiet      = getn(setupk, "Quiet");
+		setup.v02._reserved0 = getn(setupk, "Reserved[0]");
+		setup.v02._reserved1 = getn(setupk, "Reserved[1]");
+		setup.v02.keeplogs   = getn(setupk, "Keep logs");
+		setup.v02.dumpnand   = getn(setupk, "Dump NAND");
+		setup.v02._reserved2 = getn(setupk, "Reserved[2]");
+		setup.v02._reserved3 = getn(setupk, "Reserved[3]");
+		setup.v02._reserved4 = getn(setupk, "Reserved[4]");
+		setup.v02._reserved5 = getn(setupk, "Reserved[5]");
+		if (setup.type != 0)
+			throw std::runtime_error("Reserved[1] must be 0 in the 1.1.02 setup layout");
+	}
+	// Setup layouts with a version are told apart from the menu by the model,
+	// which overlaps the low byte of Reserved[4] in the menu
+	if (setupk.count("Version") && setup.model[0] != 'n')
+		throw std::runtime_error("Model must start with 'n': " + get(setupk, "Model"));
+	if (!setupk.count("Version") && setup.model[0] == 'n')
+		throw std::runtime_error("Reserved[4] low byte must not be 'n' (0x6e): " + get(setupk, "Reserved[4]"));
+	bool chunked = setup.type != 1;
+
+	uint32_t fpos[10] = {0};
+	if (devs.size() > sizeof(fpos) / sizeof(fpos[0]))
+		throw std::runtime_error("Too many devices: " + std::to_string(devs.size()));
+
+	int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		throw std::runtime_error("Could not open output file " + out);
+
+	try {
+		// Sections at constant offsets
+		for (auto &f: fixed) {
+			std::string file = path(f.file);
+			unsigned long size;
+			auto map = map_file(file, size);
+			if (size > f.size)
+				throw std::runtime_error("Section " + file + " larger than " + std::to_string(f.size) + " bytes");
+			std::vector<uint8_t> data(f.size, 0);
+			memcpy(data.data(), map.get(), size);
+			codec_xor(data.data(), data.data(), data.size(), pattern, sizeof(pattern), 0);
+			pwrite_full(fd, data.data(), data.size(), f.offset);
+			std::clog << "if=" << file << " of=" << out << " seek=" << f.offset << " size=" << f.size << std::endl;
+		}
+
+		// Setup, device table, system data sections and file offset table
+		std::vector<uint8_t> header(reinterpret_cast<uint8_t *>(&setup),
+				reinterpret_cast<uint8_t *>(&setup) + setup_size);
+		auto append = [&](const void *p, unsigned long size) {
+			header.insert(header.end(), static_cast<const uint8_t *>(p),
+					static_cast<const uint8_t *>(p) + size);
+		};
+		uint32_t ndev = devs.size();
+		append(&ndev, sizeof(ndev));
+		unsigned long devtab = header.size();
+		header.resize(header.size() + ndev * sizeof(device_t::raw));
+
+		uint32_t nsys = syss.size();
+		append(&nsys, sizeof(nsys));
+		for (auto &k: syss) {
+			std::string file = path(get(k, "Dumped file"));
+			unsigned long size;
+			auto map = map_file(file, size);
+			system_t sys;
+			memset(&sys, 0, sizeof(sys));
+			sys.index = getn(k, "Index");
+			sys.size = size;
+			sys.compressed = getn(k, "Compressed");
+			sys.rawsize = sys.compressed ? getn(k, "Uncompressed size") : size;
+			append(&sys, sizeof(sys.raw));
+			append(map.get(), size);
+		}
+		unsigned long fpostab = header.size();
+		header.resize(header.size() + sizeof(fpos));
+
+		// Device data sections, at their logged offsets while they still fit
+		unsigned long offset = 0x30000 + header.size();
+		for (uint32_t i = 0; i < ndev; i++) {
+			const keys_t &k = devs[i];
+			std::string file = path(get(k, "Dumped file"));
+			unsigned long size;
+			auto map = map_file(file, size);
+			map_advise(map.get(), size, MADV_SEQUENTIAL);
+
+			device_t dev;
+			dev.type = getn(k, "Type");
+			dev.dest = destination(get(k, "Destination"));
+			dev.compressed = getn(k, "Compressed");
+			dev.pattern = getn(k, "XOR pattern");
+			dev.cksum = getn(k, "Checksum");
+			offset = std::max(offset, (unsigned long)getn(k, "Offset"));
+			fpos[i] = offset;
+
+			uint64_t xpattern;
+			uint32_t xsize;
+			const void *px = select_pattern(dev.pattern, xpattern, xsize);
+			if (chunked && dev.compressed) {
+				dev.size = deflate_chunks(fd, offset, map.get(), size, px, xsize);
+				dev.rawsize = size;
+			} else {
+				write_xor(fd, offset, map.get(), size, px, xsize);
+				dev.size = size;
+				dev.rawsize = dev.compressed ? getn(k, "Uncompressed size") : size;
+			}
+			std::clog << "if=" << file << " of=" << out << " seek=" << offset << " size=" << dev.size << std::endl;
+			memcpy(&header[devtab + i * sizeof(dev.raw)], &dev, sizeof(dev.raw));
+			offset += dev.size;
+		}
+		memcpy(&header[fpostab], fpos, sizeof(fpos));
+		pwrite_full(fd, header.data(), header.size(), 0x30000);
+	} catch (...) {
+		close(fd);
+		throw;
 	}
+	if (close(fd) != 0)
+		throw std::runtime_error("Could not write output file " + out);
 }
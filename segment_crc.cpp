@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "crc32.h"
+#include "io.h"
+#include "segment_crc.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+uint32_t np_crc32(uint32_t crc, const void *buf, size_t size)
+{
+	return 0xffffffff ^ crc32(crc ^ 0xffffffff, buf, size);
+}
+
+static unsigned long unmap_prefix_scalar(const uint8_t *buf, unsigned long size)
+{
+	unsigned long i = 0;
+	for (uint64_t v; i + 8 <= size; i += 8) {
+		memcpy(&v, buf + i, sizeof(v));
+		if (v != ~0ULL)
+			break;
+	}
+	while (i < size && buf[i] == 0xff)
+		i++;
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static unsigned long unmap_prefix_avx2(const uint8_t *buf, unsigned long size)
+{
+	const __m256i ones = _mm256_set1_epi8(-1);
+	unsigned long i = 0;
+	for (; i + 128 <= size; i += 128) {
+		const __m256i *p = reinterpret_cast<const __m256i *>(buf + i);
+		__m256i v = _mm256_and_si256(_mm256_and_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+				_mm256_and_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+		if (!_mm256_testc_si256(v, ones))
+			break;
+	}
+	return i + unmap_prefix_scalar(buf + i, size - i);
+}
+
+static bool unmap_cpu_avx2()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+const unmap_kernel_t unmap_kernels[] = {
+	{"scalar", true, unmap_prefix_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+	{"avx2", unmap_cpu_avx2(), unmap_prefix_avx2},
+#endif
+	{nullptr, false, nullptr},
+};
+
+// Fastest supported kernel, selected on first use from CPU features
+static unmap_prefix_t unmap_default()
+{
+	static const unmap_prefix_t f = [] {
+		unmap_prefix_t f = unmap_prefix_scalar;
+		for (const unmap_kernel_t *k = unmap_kernels; k->name; k++)
+			if (k->supported)
+				f = k->f;
+		return f;
+	}();
+	return f;
+}
+
+// Checksum of size bytes of 0xff
+static uint32_t np_crc32_unmap(uint32_t crc, unsigned long size)
+{
+	static const std::vector<uint8_t> ff(4096, 0xff);
+	for (unsigned long s; size; size -= s) {
+		s = std::min(size, ff.size());
+		crc = np_crc32(crc, ff.data(), s);
+	}
+	return crc;
+}
+
+// Minimum bytes per checksum thread, low enough that the block_size
+// windows of the buffered paths are split too
+static const unsigned long crc_min_chunk = 1024 * 1024;
+
+segment_crc_t::segment_crc_t(uint32_t fstype, const geometry_t &geo, unmap_prefix_t unmap) :
+	fstype(fstype), geo(geo), unmap(unmap ? unmap : unmap_default())
+{
+	if (fstype == FsUbifs) {
+		if (!geo.leb)
+			throw std::runtime_error("Unknown ubifs LEB size for " + std::string(geo.tag));
+		ubifs = true;
+		lo = 4;
+		record = hi = geo.leb + 4;
+	} else if (fstype == FsRawNand) {
+		if (!geo.page)
+			throw std::runtime_error("Unknown NAND size for " + std::string(geo.tag));
+		hi = geo.page;
+		record = geo.page + geo.oob;
+	}
+}
+
+// Whole records of large chunks are checksummed on worker threads,
+// after the serial end of a record left open by the previous chunk
+void segment_crc_t::update(const void *buf, unsigned long size)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(buf);
+	unsigned long n = threads ? threads : std::thread::hardware_concurrency();
+	unsigned long r = std::max(1UL, record);
+	unsigned long head = pos ? std::min(size, r - pos) : 0;
+	unsigned long bulk = (size - head) / r * r;
+	if (n > 1 && bulk >= 2 * crc_min_chunk) {
+		update_serial(p, head);
+		p += head;
+		size -= head;
+		size_t blen;
+		uint32_t bcrc = crc32_split(bulk, record, n, crc_min_chunk, [&](size_t start, size_t s, size_t *plen) {
+			segment_crc_t part(fstype, geo, unmap);
+			part.update_serial(p + start, s);
+			return part.final(plen);
+		}, &blen);
+		crc0 = crc = crc32_combine(crc, bcrc, blen);
+		len0 = len += blen;
+		p += bulk;
+		size -= bulk;
+	}
+	update_serial(p, size);
+}
+
+uint32_t segment_crc_t::final(unsigned long *plen)
+{
+	if (pos)
+		commit(pos < 4);
+	if (plen)
+		*plen = len;
+	return crc;
+}
+
+void segment_crc_t::update_serial(const uint8_t *p, unsigned long size)
+{
+	if (!record) {
+		crc = np_crc32(crc, p, size);
+		len += size;
+		return;
+	}
+	while (size) {
+		unsigned long s = std::min(size, record - pos);
+		unsigned long a = std::max(pos, lo), b = std::min(pos + s, hi);
+		if (a < b) {
+			const uint8_t *pd = p + (a - pos);
+			unsigned long n = b - a;
+			// ubirefimg: First u32 means number of skipped unmapped LEBs
+			// so an erased LEB should never be found in ubirefimg images.
+			// Erased bytes are only scanned, their checksum is deferred
+			// until the LEB turns out to hold data.
+			if (ubifs && erased) {
+				unsigned long ff = unmap(pd, n);
+				unmapped += ff;
+				if (ff == n) {
+					n = 0;
+				} else {
+					erased = false;
+					crc = np_crc32_unmap(crc, unmapped);
+					len += unmapped;
+					pd += ff;
+					n -= ff;
+				}
+			}
+			crc = np_crc32(crc, pd, n);
+			len += n;
+		}
+		p += s;
+		pos += s;
+		size -= s;
+		if (pos == record)
+			commit(false);
+	}
+}
+
+// End of record, roll back its contribution if it should be skipped
+void segment_crc_t::commit(bool skip)
+{
+	if (skip || (ubifs && erased)) {
+		crc = crc0;
+		len = len0;
+	}
+	crc0 = crc;
+	len0 = len;
+	pos = 0;
+	erased = true;
+	unmapped = 0;
+}
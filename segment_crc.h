@@ -0,0 +1,70 @@
+#ifndef SEGMENT_CRC_H
+#define SEGMENT_CRC_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Filesystem types of upgrade.bin segments
+enum fs_type_t {
+	FsNone,
+	FsMsdos,
+	FsUnknown2,
+	FsYaffs,
+	FsRawNand,
+	FsUnknown5,
+	FsRaw,
+	FsNor,
+	FsUbifs,
+};
+
+// Flash geometry of a device: ubifs LEB size, raw NAND page and OOB sizes,
+// 0 where the device has none, and segment alignment in the image
+struct geometry_t {
+	char tag[9];
+	unsigned long leb, page, oob, align;
+};
+
+// CRC-32 without pre and post inversion, as upgrade.bin headers store it
+uint32_t np_crc32(uint32_t crc, const void *buf, size_t size);
+
+// Length of the run of 0xff bytes at the start of buf, erased flash
+typedef unsigned long (*unmap_prefix_t)(const uint8_t *buf, unsigned long size);
+
+// Kernels for unmap_prefix_t, slowest first, for the benchmark. The
+// fastest supported one is used by default; the list ends with a null name.
+struct unmap_kernel_t {
+	const char *name;
+	bool supported;
+	unmap_prefix_t f;
+};
+extern const unmap_kernel_t unmap_kernels[];
+
+// Incremental segment checksum, fed with consecutive chunks of segment data.
+// ubifs images are made of LEB+4 byte records, raw NAND images of page+OOB
+// byte records; only the LEB or page part of each record is checksummed.
+// Trailing records shorter than 4 bytes are ignored. Large chunks are
+// checksummed on --threads worker threads.
+class segment_crc_t
+{
+public:
+	segment_crc_t(uint32_t fstype, const geometry_t &geo, unmap_prefix_t unmap = nullptr);
+
+	void update(const void *buf, unsigned long size);
+
+	// Checksum and number of bytes checksummed
+	uint32_t final(unsigned long *plen = nullptr);
+
+private:
+	void update_serial(const uint8_t *p, unsigned long size);
+	void commit(bool skip);
+
+	uint32_t fstype;
+	geometry_t geo;
+	unmap_prefix_t unmap;
+	bool ubifs = false, erased = true;
+	unsigned long record = 0, lo = 0, hi = 0, pos = 0, unmapped = 0;
+	unsigned long len = 0, len0 = 0;
+	uint32_t crc = 0, crc0 = 0;
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include <stdexcept>
 #include <cstdint>
 #include <cstring>
+#include "codec.h"
 
 // XOR pattern extracted from NP890 update.bin
 static const uint8_t pattern_890[] = {
@@ -16,24 +17,6 @@ static const uint8_t pattern_890[] = {
 	0x3a, 0x22, 0x0a, 0x33, 0x3e, 0x26, 0x0e, 0x35,  0x1d, 0x05, 0x2c, 0x14, 0x1b, 0x03, 0x0a, 0x04,
 };
 
-void codec_xor(void *p, unsigned long size, const void *pattern, const unsigned long psize)
-{
-	if (size % 8)
-		throw std::runtime_error("Unexpected codec block size " + std::to_string(size));
-	if (psize % 8)
-		throw std::runtime_error("Unexpected pattern block size " + std::to_string(psize));
-
-	uint64_t *pv = static_cast<uint64_t *>(p);
-	const uint64_t *pp = static_cast<const uint64_t *>(pattern);
-	unsigned long i = 0;
-	unsigned long ps = psize / 8;
-	while (size) {
-		*pv++ ^= *(pp + i);
-		i = (i + 1) % ps;
-		size -= 8;
-	}
-}
-
 void extract(const std::string &in, const std::string &out, const void *pp, const unsigned long psize, unsigned long offset, unsigned long size)
 {
 	std::ifstream sin(in, std::ios::binary);
@@ -49,11 +32,10 @@ void extract(const std::string &in, const std::string &out, const void *pp, cons
 
 	// Read file in blocks of 4k bytes
 	uint8_t block[4096];
-	unsigned long read = 0;
+	unsigned long read = 0, phase = 0;
 	while (sin.read(reinterpret_cast<char *>(block), sizeof(block)), (read = sin.gcount()) != 0) {
 		unsigned long wsize = size ? std::min(size, read) : read;
-		unsigned long bsize = (wsize + 7) / 8 * 8;
-		codec_xor(block, bsize, pp, psize);
+		phase = codec_xor(block, block, wsize, pp, psize, phase);
 		sout.write(reinterpret_cast<char *>(block), wsize);
 		if (size) {
 			size -= wsize;